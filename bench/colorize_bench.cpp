@@ -0,0 +1,96 @@
+// Checks colorize_tile against the float loop the 2D renderers used before
+// it, and times both. Fails if any channel is more than 1 off.
+//
+//   colorize_bench [tiles] [size]
+//
+// defaults to 4096 random 32x32 tiles.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../g_src/tile_colorize.h"
+
+// The float loop from tile_cache_lookup, as it was. It leaves the fourth
+// byte alone; colorize_tile zeroes it.
+static void reference_colorize(const uint8_t *src, int src_pitch, uint8_t *dst, int dst_pitch,
+                               int w, int h, uint32_t fg, uint32_t bg) {
+  const uint8_t *color_fg = (const uint8_t*) &fg;
+  const uint8_t *color_bg = (const uint8_t*) &bg;
+  for (int y = 0; y < h; y++) {
+    const uint8_t *pixel_src = src + y * src_pitch;
+    uint8_t *pixel_dst = dst + y * dst_pitch;
+    for (int x = 0; x < w; x++, pixel_src+=4, pixel_dst+=4) {
+      float alpha = pixel_src[3] / 255.0;
+      for (int c = 0; c < 3; c++) {
+        float fg = color_fg[c] / 255.0, bg = color_bg[c] / 255.0, tex = pixel_src[c] / 255.0;
+        pixel_dst[c] = ((alpha * (tex * fg)) + ((1 - alpha) * bg)) * 255;
+      }
+    }
+  }
+}
+
+typedef void (*colorize_fn)(const uint8_t*, int, uint8_t*, int, int, int, uint32_t, uint32_t);
+
+// Microseconds per tile, best of a few runs
+static double time_tiles(colorize_fn fn, const std::vector<uint8_t> &src, std::vector<uint8_t> &dst,
+                         const std::vector<uint32_t> &colors, int tiles, int size) {
+  const int pitch = size * 4, bytes = pitch * size;
+  double best = 0;
+  for (int run = 0; run < 5; run++) {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int t = 0; t < tiles; t++)
+      fn(&src[t * bytes], pitch, &dst[t * bytes], pitch, size, size, colors[t * 2], colors[t * 2 + 1]);
+    const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    if (!run || us < best) best = us;
+  }
+  return best / tiles;
+}
+
+int main(int argc, char *argv[]) {
+  const int tiles = argc > 1 ? atoi(argv[1]) : 4096;
+  const int size = argc > 2 ? atoi(argv[2]) : 32;
+  if (tiles < 1 || size < 1) {
+    fprintf(stderr, "usage: %s [tiles] [size]\n", argv[0]);
+    return 2;
+  }
+  const int bytes = size * size * 4;
+
+  // Tilesets are mostly fully opaque or fully clear, so weight those
+  srand(1);
+  std::vector<uint8_t> src((size_t)tiles * bytes);
+  for (size_t i = 0; i < src.size(); i++) {
+    if (i % 4 == 3) {
+      const int r = rand() % 4;
+      src[i] = r == 0 ? 0 : r == 1 ? 255 : rand() % 256;
+    } else
+      src[i] = rand() % 256;
+  }
+  std::vector<uint32_t> colors(tiles * 2);
+  for (int i = 0; i < tiles * 2; i++)
+    colors[i] = (uint32_t)(rand() % 256) | (rand() % 256) << 8 | (rand() % 256) << 16;
+
+  std::vector<uint8_t> want(src.size()), got(src.size());
+  const double reference_us = time_tiles(reference_colorize, src, want, colors, tiles, size);
+  const double kernel_us = time_tiles(colorize_tile, src, got, colors, tiles, size);
+
+  int worst = 0;
+  size_t differ = 0;
+  for (size_t i = 0; i < src.size(); i++) {
+    if (i % 4 == 3) continue;
+    const int d = abs(want[i] - got[i]);
+    if (d > worst) worst = d;
+    if (d) differ++;
+  }
+
+  printf("%d %dx%d tiles: float loop %.2f us/tile, colorize_tile %.2f us/tile (%.1fx)\n",
+         tiles, size, size, reference_us, kernel_us, reference_us / kernel_us);
+  printf("%zu of %zu channels differ, by at most %d\n", differ, src.size() / 4 * 3, worst);
+  if (worst > 1) {
+    printf("FAILED: colorize_tile is more than 1 off the float loop\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,289 @@
+// Checks SDL_Resample against the double precision Lanczos resampler it
+// replaced, and times both. Fails if any channel is more than 1 off.
+//
+//   resize_bench [threads]
+//
+// threads is RENDER_THREADS for the large image, which goes through
+// render_workers; 0, the default, is one per core.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+#include "../g_src/resize++.h"
+#include "../g_src/worker_pool.hpp"
+
+// resize++.cpp uses these; the game's are in enabler.cpp and init.cpp
+init_tuningst init_tuning;
+worker_pool render_workers;
+
+#ifndef M_PI
+#define M_PI    3.14159265359
+#endif
+
+// resize++.cpp's Resample, as it was
+static inline double Lanczos(double x, int Radius)
+{
+  if (x == 0.0) return 1.0;
+  if (x <= -Radius || x >= Radius) return 0.0;
+  double tmp = x * M_PI;
+  return Radius * std::sin(tmp) * std::sin(tmp / Radius) / (tmp * tmp);
+}
+
+static void reference_resample(SDL_Surface * src, SDL_Surface * dst, int filter)
+{
+    const double blur = 1.0;
+    double factor  = dst->w / (double)src->w;
+    double scale   = std::min(factor, 1.0) / blur;
+    int FilterRadius = filter;
+    if (filter < 1 )
+        FilterRadius = 1;
+    if (filter > 3) //automatically determine fastest filter setting
+    {
+        FilterRadius = 3;
+        if (scale < 0.67) FilterRadius = 2;
+        if (scale <= 0.5) FilterRadius = 1;        
+    }
+    double support = FilterRadius / scale; 
+
+    std::vector<double> contribution_x(std::min((size_t)src->w, 5+(size_t)(2*support)));    
+    /* 5 = room for rounding up in calculations of start, stop and support */
+
+    Uint32 ** temp = new Uint32 * [src->h]; //array of source->height * dest->width
+    for (int i = 0 ; i < src->h; i++)
+        temp[i] = new Uint32 [dst->w];
+
+    if (support <= 0.5) { support = 0.5 + 1E-12; scale = 1.0; }
+
+    for (int x = 0; x < dst->w; ++x)
+    {
+        double center = (x + 0.5) / factor;
+        size_t start = (size_t)std::max(center - support + 0.5, (double)0);
+        size_t stop  = (size_t)std::min(center + support + 0.5, (double)src->w);
+        double density = 0.0;
+        size_t nmax = stop - start;
+        double s = start - center + 0.5;
+        double point[4] = {0,0,0,0};
+        Uint8 v;
+        double diff;
+
+        for (int y = 0; y < src->h; y++)
+        {                        
+            for (size_t n = 0; n < nmax; ++n)
+            {
+                if (y == 0)
+                { //only come up with the contribution list once per column.
+                    contribution_x[n] = Lanczos (s * scale, FilterRadius);                
+                    density += contribution_x[n];
+                    s++;
+                }
+                //it MUST be a 32-bit surface for following code to work correctly
+                Uint8 * p = (Uint8 *)src->pixels + y * src->pitch + (start+n) * 4;
+                for (int c = 0; c < 4; c++)
+                    point[c] += p[c] * contribution_x[n];
+            }
+            /* Normalize. Truncate to Uint8 values. Place in temp array*/
+            Uint8 * p = (Uint8 *)&temp[y][x];
+            for (size_t c = 0; c < 4; c++)
+            {
+                if (density != 0.0 && density != 1.0)
+                    point[c] /= density;
+                if (point[c] < 0)
+                    point[c] = 0;
+                if (point[c] > 255)
+                    point[c] = 255;
+	            v = (Uint8) point[c];
+	            diff = point[c] - (double)v;
+	            if (diff < 0)
+		            diff = -diff;
+	            if (diff >= 0.5)
+                    v++;
+	            p[c] = v;
+                point[c] = 0; //reset value for next loop
+            }
+        }
+    }
+
+    factor  = dst->h / (double)src->h;
+    scale   = std::min(factor, 1.0) / blur;
+    if (filter > 3) //automatically determine fastest filter setting
+    {
+        FilterRadius = 3;
+        if (scale < 0.67) FilterRadius = 2;
+        if (scale <= 0.5) FilterRadius = 1;
+    }
+    support = FilterRadius / scale;
+
+    std::vector<double> contribution_y(std::min((size_t)src->h, 5+(size_t)(2*support)));
+
+    if (support <= 0.5) { support = 0.5 + 1E-12; scale = 1.0; }
+
+    for (int y = 0; y<dst->h; ++y)
+    {
+        double center = (y + 0.5) / factor;
+        size_t start = (size_t)std::max(center - support + 0.5, (double)0);
+        size_t stop  = (size_t)std::min(center + support + 0.5, (double)src->h);
+        double density = 0.0;
+        size_t nmax = stop-start;
+        double s = start - center+0.5;
+        double point[4] = {0,0,0,0};
+        Uint8 v;
+        double diff;
+        
+        for (int x=0; x<dst->w; x++)
+        {    
+            for (size_t n=0; n<nmax; ++n)
+            {
+                if (x == 0)
+                {
+                    contribution_y[n] = Lanczos(s * scale, FilterRadius);
+                    density += contribution_y[n];
+                    s++;
+                }
+                Uint8 * p = (Uint8 *)&temp[start+n][x];
+                for (int c = 0; c < 4; c++)
+                    point[c] += p[c] * contribution_y[n];
+            }
+            //destination must also be a 32 bit surface for this to work!
+            Uint8 * p = (Uint8 *)dst->pixels + y * dst->pitch + x * 4;
+            for (size_t c = 0; c < 4; c++)
+            {
+                if (density != 0.0 && density != 1.0)
+                    point[c] /= density;
+                if (point[c] < 0)
+                    point[c] = 0;
+                if (point[c] > 255)
+                    point[c] = 255;
+                v = (Uint8) point[c];
+	            diff = point[c] - (double)v;
+	            if (diff < 0)
+		            diff = -diff;
+	            if (diff >= 0.5)
+			        v++;
+	            p[c] = v;
+                point[c] = 0;
+            }
+        }
+    }
+
+    //free the temp array, so we don't leak any memory
+    for (int i = 0 ; i < src->h; i++)
+        delete [] temp[i];
+    delete [] temp;
+}
+
+static SDL_Surface *make_surface(int w, int h) {
+  SDL_Surface *s = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32,
+                                        0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+  if (!s) {
+    fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
+    exit(2);
+  }
+  return s;
+}
+
+// Tiles are mostly runs of fully on and fully off pixels, the worst case
+// for ringing; mix some noise in
+static void fill_random(SDL_Surface *s) {
+  for (int y = 0; y < s->h; y++) {
+    Uint8 *p = (Uint8*)s->pixels + y * s->pitch;
+    for (int x = 0; x < s->w * 4; x++)
+      p[x] = rand() % 4 == 0 ? rand() % 256 : (rand() % 2 ? 255 : 0);
+  }
+}
+
+// Largest difference between two surfaces of the same size
+static int compare(SDL_Surface *a, SDL_Surface *b, long &differ) {
+  int worst = 0;
+  for (int y = 0; y < a->h; y++) {
+    const Uint8 *p = (const Uint8*)a->pixels + y * a->pitch;
+    const Uint8 *q = (const Uint8*)b->pixels + y * b->pitch;
+    for (int x = 0; x < a->w * 4; x++) {
+      const int d = abs(p[x] - q[x]);
+      worst = std::max(worst, d);
+      if (d) differ++;
+    }
+  }
+  return worst;
+}
+
+typedef void (*resample_fn)(SDL_Surface*, SDL_Surface*, int);
+
+// Microseconds per call, best of a few batches
+static double time_resample(resample_fn fn, SDL_Surface *src, SDL_Surface *dst, int reps) {
+  double best = 0;
+  for (int run = 0; run < 3; run++) {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < reps; i++)
+      fn(src, dst, 4);
+    const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    if (!run || us < best) best = us;
+  }
+  return best / reps;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) init_tuning.render_threads = atoi(argv[1]);
+  srand(5);
+
+  // Accuracy: up and down scales, odd sizes and degenerate ones, with every
+  // filter setting. The last one is big enough for render_workers.
+  static const int sizes[][4] = {
+    {16, 16, 12, 12}, {16, 16, 24, 24}, {16, 16, 37, 29}, {32, 32, 13, 13},
+    {8, 12, 64, 96}, {16, 16, 16, 16}, {16, 16, 5, 3}, {300, 200, 1, 1},
+    {1, 1, 20, 20}, {1, 7, 3, 2}, {16, 16, 17, 15}, {12, 12, 100, 100},
+    {200, 150, 400, 300}
+  };
+  int worst = 0;
+  long differ = 0, total = 0;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    const int *z = sizes[i];
+    for (int trial = 0; trial < 5; trial++) {
+      for (int filter = 0; filter <= 4; filter++) {
+        SDL_Surface *src = make_surface(z[0], z[1]);
+        SDL_Surface *want = make_surface(z[2], z[3]), *got = make_surface(z[2], z[3]);
+        fill_random(src);
+        reference_resample(src, want, filter);
+        SDL_Resample(src, got, filter);
+        const int d = compare(want, got, differ);
+        if (d > 1)
+          printf("%dx%d -> %dx%d, filter %d: %d off\n", z[0], z[1], z[2], z[3], filter, d);
+        worst = std::max(worst, d);
+        total += (long)z[2] * z[3] * 4;
+        SDL_FreeSurface(src);
+        SDL_FreeSurface(want);
+        SDL_FreeSurface(got);
+      }
+    }
+  }
+  printf("%ld of %ld channels differ, by at most %d\n", differ, total, worst);
+
+  // Speed: tile sized scales, as the 2D renderers do on a cache miss, and
+  // a whole image on render_workers
+  static const int timed[][5] = {
+    {16, 16, 24, 24, 2000}, {32, 32, 20, 20, 2000}, {800, 600, 1600, 1200, 3}
+  };
+  for (size_t i = 0; i < sizeof(timed) / sizeof(timed[0]); i++) {
+    const int *z = timed[i];
+    SDL_Surface *src = make_surface(z[0], z[1]), *dst = make_surface(z[2], z[3]);
+    fill_random(src);
+    const double reference_us = time_resample(reference_resample, src, dst, z[4]);
+    const double resample_us = time_resample(SDL_Resample, src, dst, z[4]);
+    printf("%dx%d -> %dx%d: reference %.1f us, SDL_Resample %.1f us (%.1fx)",
+           z[0], z[1], z[2], z[3], reference_us, resample_us, reference_us / resample_us);
+    if ((long)z[2] * z[3] >= 256 * 256)
+      printf(", %d threads", render_workers.size());
+    printf("\n");
+    SDL_FreeSurface(src);
+    SDL_FreeSurface(dst);
+  }
+
+  if (worst > 1) {
+    printf("FAILED: SDL_Resample is more than 1 off the reference\n");
+    return 1;
+  }
+  return 0;
+}
@@ -5,12 +5,16 @@
 #endif
 
 #include <cassert>
+#include <deque>
+#include <fstream>
+#include <iterator>
 
 #include "platform.h"
 #include "enabler.h"
 #include "random.h"
 #include "init.h"
 #include "music_and_sound_g.h"
+#include "worker_pool.hpp"
 
 #ifdef unix
 # include <locale.h>
@@ -19,13 +23,21 @@
 using namespace std;
 
 enablerst enabler;
+worker_pool render_workers;
 
 // For the printGLError macro
 int glerrorcount = 0;
+bool gl_debug_output = false;
+
+gl_state_cache gl_state;
 
 // Set to 0 when the game wants to quit
 static int loopvar = 1;
 
+// Fences on the frames the GPU may still be drawing, oldest first.
+// enablerst::sync is the front one.
+static deque<GLsync> frame_fences;
+
 // Reports an error to the user, using a MessageBox and stderr.
 void report_error(const char *error_preface, const char *error_message)
 {
@@ -39,8 +51,13 @@ void report_error(const char *error_preface, const char *error_message)
 }
 
 Either<texture_fullid,texture_ttfid> renderer::screen_to_texid(int x, int y) {
-  const int tile = x * gps.dimy + y;
+  const int tile = gps.tile_index(x, y);
+#ifdef GPS_PACKED_CELLS
+  const tile_cell &cell = cells[tile];
+  const unsigned char *s = cell.screen;
+#else
   const unsigned char *s = screen + tile*4;
+#endif
 
   struct texture_fullid ret;
   int ch;
@@ -68,26 +85,30 @@ Either<texture_fullid,texture_ttfid> renderer::screen_to_texid(int x, int y) {
   static bool use_graphics = init.display.flag.has_flag(INIT_DISPLAY_FLAG_USE_GRAPHICS);
   
   if (use_graphics) {
+#ifdef GPS_PACKED_CELLS
+    const long texpos             = cell.texpos;
+    const char addcolor           = cell.addcolor;
+    const unsigned char grayscale = cell.grayscale;
+    const unsigned char cf        = cell.cf;
+    const unsigned char cbr       = cell.cbr;
+#else
     const long texpos             = screentexpos[tile];
     const char addcolor           = screentexpos_addcolor[tile];
     const unsigned char grayscale = screentexpos_grayscale[tile];
     const unsigned char cf        = screentexpos_cf[tile];
     const unsigned char cbr       = screentexpos_cbr[tile];
+#endif
 
     if (texpos) {
       ret.texpos = texpos;
       if (grayscale) {
-        ret.r = enabler.ccolor[cf][0];
-        ret.g = enabler.ccolor[cf][1];
-        ret.b = enabler.ccolor[cf][2];
-        ret.br = enabler.ccolor[cbr][0];
-        ret.bg = enabler.ccolor[cbr][1];
-        ret.bb = enabler.ccolor[cbr][2];
+        ret.fg = cf;
+        ret.bg = cbr;
       } else if (addcolor) {
         goto use_ch;
       } else {
-        ret.r = ret.g = ret.b = 1;
-        ret.br = ret.bg = ret.bb = 0;
+        ret.fg = PALETTE_WHITE;
+        ret.bg = PALETTE_BLACK;
       }
       goto skip_ch;
     }
@@ -97,12 +118,8 @@ Either<texture_fullid,texture_ttfid> renderer::screen_to_texid(int x, int y) {
     init.font.large_font_texpos[ch] :
     init.font.small_font_texpos[ch];
  use_ch:
-  ret.r = enabler.ccolor[fg][0];
-  ret.g = enabler.ccolor[fg][1];
-  ret.b = enabler.ccolor[fg][2];
-  ret.br = enabler.ccolor[bg][0];
-  ret.bg = enabler.ccolor[bg][1];
-  ret.bb = enabler.ccolor[bg][2];
+  ret.fg = fg;
+  ret.bg = bg;
 
  skip_ch:
 
@@ -115,6 +132,7 @@ Either<texture_fullid,texture_ttfid> renderer::screen_to_texid(int x, int y) {
 #endif
 #include "renderer_2d.hpp"
 #include "renderer_opengl.hpp"
+#include "renderer_shader.hpp"
 
 
 enablerst::enablerst() {
@@ -125,70 +143,128 @@ enablerst::enablerst() {
   fps = 100; gfps = 20;
   fps_per_gfps = fps / gfps;
   last_tick = 0;
+  render_pending = textures_stale = false;
 }
 
 void renderer::display()
 {
-  const int dimx = init.display.grid_x;
-  const int dimy = init.display.grid_y;
-  static bool use_graphics = init.display.flag.has_flag(INIT_DISPLAY_FLAG_USE_GRAPHICS);
-  if (gps.force_full_display_count) {
+  if (display_all || frames[shown].full) {
     // Update the entire screen
     update_all();
+    display_all = false;
   } else {
-    Uint32 *screenp = (Uint32*)screen, *oldp = (Uint32*)screen_old;
-    if (use_graphics) {
-      int off = 0;
-      for (int x2=0; x2 < dimx; x2++) {
-        for (int y2=0; y2 < dimy; y2++, ++off, ++screenp, ++oldp) {
-          // We don't use pointers for the non-screen arrays because we mostly fail at the
-          // *first* comparison, and having pointers for the others would exceed register
-          // count.
-          // Partial printing (and color-conversion): Big-ass if.
-          if (*screenp == *oldp &&
-              screentexpos[off] == screentexpos_old[off] &&
-              screentexpos_addcolor[off] == screentexpos_addcolor_old[off] &&
-              screentexpos_grayscale[off] == screentexpos_grayscale_old[off] &&
-              screentexpos_cf[off] == screentexpos_cf_old[off] &&
-              screentexpos_cbr[off] == screentexpos_cbr_old[off])
-            {
-              // Nothing's changed, this clause deliberately empty
-            } else {
-            update_tile(x2, y2);
-          }
-        }
-      }
-    } else {
-      for (int x2=0; x2 < dimx; ++x2) {
-        for (int y2=0; y2 < dimy; ++y2, ++screenp, ++oldp) {
-          if (*screenp != *oldp) {
-            update_tile(x2, y2);
-          }
-        }
-      }
+    for_each_dirty_run(&renderer::update_changed);
+  }
+}
+
+// A tile can only differ from _old if its line has a different stamp in the
+// two frames. Calls fn on each run of such lines, as a range of tiles.
+void renderer::for_each_dirty_run(void (renderer::*fn)(int, int)) {
+  const int lines = gps.line_count(), line_len = gps.dimx * gps.dimy / lines;
+  for (int line = 0; line < lines;) {
+    if (line_stamp[line] == line_stamp_old[line]) {
+      line++;
+      continue;
     }
+    int end = line + 1;
+    while (end < lines && line_stamp[end] != line_stamp_old[end])
+      end++;
+    (this->*fn)(line * line_len, end * line_len);
+    line = end;
   }
-  if (gps.force_full_display_count > 0) gps.force_full_display_count--;
+}
+
+// Diffs tiles [begin, end) against _old and calls update_tile on the changes
+void renderer::update_changed(int begin, int end) {
+  const int first = begin >> 5, last = (end - 1) >> 5;
+  memset(tile_dirty + first, 0, (last - first + 1) * sizeof(uint32_t));
+#ifdef GPS_PACKED_CELLS
+  diff_cells(cells, cells_old, begin, end, tile_dirty);
+#else
+  static bool use_graphics = init.display.flag.has_flag(INIT_DISPLAY_FLAG_USE_GRAPHICS);
+  const tile_planes cur = { screen, screentexpos, screentexpos_addcolor,
+                            screentexpos_grayscale, screentexpos_cf, screentexpos_cbr };
+  const tile_planes old = { screen_old, screentexpos_old, screentexpos_addcolor_old,
+                            screentexpos_grayscale_old, screentexpos_cf_old, screentexpos_cbr_old };
+  if (use_graphics)
+    diff_tiles<true>(cur, old, begin, end, tile_dirty);
+  else
+    diff_tiles<false>(cur, old, begin, end, tile_dirty);
+#endif
+  // Walk the set bits, in memory order
+  for (int w = first; w <= last; w++) {
+    for (uint32_t word = tile_dirty[w]; word; word &= word - 1) {
+      const int tile = (w << 5) + lowest_bit(word);
+      update_tile(gps.tile_x(tile), gps.tile_y(tile));
+    }
+  }
+}
+
+const unsigned char *renderer::tile_screen(int x, int y) {
+#ifdef GPS_PACKED_CELLS
+  return cells[gps.tile_index(x, y)].screen;
+#else
+  return screen + gps.tile_index(x, y) * 4;
+#endif
 }
 
 void renderer::cleanup_arrays() {
+  for (int i = 0; i < 4; i++) {
+    gps_frame &f = frames[i];
+#ifdef GPS_PACKED_CELLS
+    if (f.cells) delete[] f.cells;
+#else
+    if (f.screen) delete[] f.screen;
+    if (f.screentexpos) delete[] f.screentexpos;
+    if (f.screentexpos_addcolor) delete[] f.screentexpos_addcolor;
+    if (f.screentexpos_grayscale) delete[] f.screentexpos_grayscale;
+    if (f.screentexpos_cf) delete[] f.screentexpos_cf;
+    if (f.screentexpos_cbr) delete[] f.screentexpos_cbr;
+#endif
+    if (f.line_stamp) delete[] f.line_stamp;
+  }
+  memset(frames, 0, sizeof(frames));
+#ifdef GPS_PACKED_CELLS
   if (screen) delete[] screen;
   if (screentexpos) delete[] screentexpos;
   if (screentexpos_addcolor) delete[] screentexpos_addcolor;
   if (screentexpos_grayscale) delete[] screentexpos_grayscale;
   if (screentexpos_cf) delete[] screentexpos_cf;
   if (screentexpos_cbr) delete[] screentexpos_cbr;
-  if (screen_old) delete[] screen_old;
-  if (screentexpos_old) delete[] screentexpos_old;
-  if (screentexpos_addcolor_old) delete[] screentexpos_addcolor_old;
-  if (screentexpos_grayscale_old) delete[] screentexpos_grayscale_old;
-  if (screentexpos_cf_old) delete[] screentexpos_cf_old;
-  if (screentexpos_cbr_old) delete[] screentexpos_cbr_old;
+  if (planes_stamp) delete[] planes_stamp;
+#else
+  if (newest_stamp) delete[] newest_stamp;
+  if (newest_frame) delete[] newest_frame;
+#endif
+  if (tile_dirty) delete[] tile_dirty;
+  if (dirty_lines) delete[] dirty_lines;
 }
 
 void renderer::gps_allocate(int x, int y) {
   cleanup_arrays();
-  
+
+  for (int i = 0; i < 4; i++) {
+    gps_frame &f = frames[i];
+#ifdef GPS_PACKED_CELLS
+    f.cells = new tile_cell[x*y];
+    memset(f.cells, 0, x*y*sizeof(tile_cell));
+#else
+    f.screen = new unsigned char[x*y*4];
+    memset(f.screen, 0, x*y*4);
+    f.screentexpos = new long[x*y];
+    memset(f.screentexpos, 0, x*y*sizeof(long));
+    f.screentexpos_addcolor = new char[x*y];
+    memset(f.screentexpos_addcolor, 0, x*y);
+    f.screentexpos_grayscale = new unsigned char[x*y];
+    memset(f.screentexpos_grayscale, 0, x*y);
+    f.screentexpos_cf = new unsigned char[x*y];
+    memset(f.screentexpos_cf, 0, x*y);
+    f.screentexpos_cbr = new unsigned char[x*y];
+    memset(f.screentexpos_cbr, 0, x*y);
+#endif
+  }
+
+#ifdef GPS_PACKED_CELLS
   gps.screen = screen = new unsigned char[x*y*4];
   memset(screen, 0, x*y*4);
   gps.screentexpos = screentexpos = new long[x*y];
@@ -201,34 +277,175 @@ void renderer::gps_allocate(int x, int y) {
   memset(screentexpos_cf, 0, x*y);
   gps.screentexpos_cbr = screentexpos_cbr = new unsigned char[x*y];
   memset(screentexpos_cbr, 0, x*y);
+#endif
 
-  screen_old = new unsigned char[x*y*4];
-  memset(screen_old, 0, x*y*4);
-  screentexpos_old = new long[x*y];
-  memset(screentexpos_old, 0, x*y*sizeof(long));
-  screentexpos_addcolor_old = new char[x*y];
-  memset(screentexpos_addcolor_old, 0, x*y);
-  screentexpos_grayscale_old = new unsigned char[x*y];
-  memset(screentexpos_grayscale_old, 0, x*y);
-  screentexpos_cf_old = new unsigned char[x*y];
-  memset(screentexpos_cf_old, 0, x*y);
-  screentexpos_cbr_old = new unsigned char[x*y];
-  memset(screentexpos_cbr_old, 0, x*y);
+  // One word of slack for the kernels' straddling writes
+  tile_dirty = new uint32_t[((x*y) >> 5) + 2];
+  memset(tile_dirty, 0, (((x*y) >> 5) + 2) * sizeof(uint32_t));
 
   gps.resize(x,y);
-}
 
-void renderer::swap_arrays() {
-  screen = screen_old; screen_old = gps.screen; gps.screen = screen;
-  screentexpos = screentexpos_old; screentexpos_old = gps.screentexpos; gps.screentexpos = screentexpos;
-  screentexpos_addcolor = screentexpos_addcolor_old; screentexpos_addcolor_old = gps.screentexpos_addcolor; gps.screentexpos_addcolor = screentexpos_addcolor;
-  screentexpos_grayscale = screentexpos_grayscale_old; screentexpos_grayscale_old = gps.screentexpos_grayscale; gps.screentexpos_grayscale = screentexpos_grayscale;
-  screentexpos_cf = screentexpos_cf_old; screentexpos_cf_old = gps.screentexpos_cf; gps.screentexpos_cf = screentexpos_cf;
-  screentexpos_cbr = screentexpos_cbr_old; screentexpos_cbr_old = gps.screentexpos_cbr; gps.screentexpos_cbr = screentexpos_cbr;
+  // All frames start out blank, so all the stamps agree. Whoever reallocates
+  // asks for a full display anyway.
+  const int lines = gps.line_count();
+  for (int i = 0; i < 4; i++) {
+    frames[i].line_stamp = new uint32_t[lines];
+    memset(frames[i].line_stamp, 0, lines * sizeof(uint32_t));
+  }
+#ifdef GPS_PACKED_CELLS
+  planes_stamp = new uint32_t[lines];
+  memset(planes_stamp, 0, lines * sizeof(uint32_t));
+#else
+  newest_stamp = new uint32_t[lines];
+  memset(newest_stamp, 0, lines * sizeof(uint32_t));
+  newest_frame = new unsigned char[lines];
+  memset(newest_frame, 0, lines);
+#endif
+  gps.dirty_lines = dirty_lines = new unsigned char[lines];
+  memset(dirty_lines, 0, lines);
 
+  frame_count = 0;
+  ready = 1;
+  draw_frame(0);
+  show_frame(2, 3);
+}
+
+// Points gps at frames[index]
+void renderer::draw_frame(int index) {
+  drawing = index;
+#ifndef GPS_PACKED_CELLS
+  const gps_frame &f = frames[index];
+  gps.screen = f.screen;
+  gps.screentexpos = f.screentexpos;
+  gps.screentexpos_addcolor = f.screentexpos_addcolor;
+  gps.screentexpos_grayscale = f.screentexpos_grayscale;
+  gps.screentexpos_cf = f.screentexpos_cf;
+  gps.screentexpos_cbr = f.screentexpos_cbr;
+#endif
   gps.screen_limit = gps.screen + gps.dimx * gps.dimy * 4;
 }
 
+// Points the renderer's arrays at frames[cur], and the _old ones at frames[old]
+void renderer::show_frame(int cur, int old) {
+  shown = cur;
+  shown_old = old;
+#ifdef GPS_PACKED_CELLS
+  cells = frames[cur].cells;
+  cells_old = frames[old].cells;
+#else
+  screen = frames[cur].screen;
+  screentexpos = frames[cur].screentexpos;
+  screentexpos_addcolor = frames[cur].screentexpos_addcolor;
+  screentexpos_grayscale = frames[cur].screentexpos_grayscale;
+  screentexpos_cf = frames[cur].screentexpos_cf;
+  screentexpos_cbr = frames[cur].screentexpos_cbr;
+  screen_old = frames[old].screen;
+  screentexpos_old = frames[old].screentexpos;
+  screentexpos_addcolor_old = frames[old].screentexpos_addcolor;
+  screentexpos_grayscale_old = frames[old].screentexpos_grayscale;
+  screentexpos_cf_old = frames[old].screentexpos_cf;
+  screentexpos_cbr_old = frames[old].screentexpos_cbr;
+#endif
+  line_stamp = frames[cur].line_stamp;
+  line_stamp_old = frames[old].line_stamp;
+}
+
+void renderer::publish_frame() {
+  static bool dirty_tracking = init.display.flag.has_flag(INIT_DISPLAY_FLAG_DIRTY_TRACKING);
+  const int lines = gps.line_count(), line_len = gps.dimx * gps.dimy / lines;
+  gps_frame &f = frames[drawing];
+
+  // Stamp the lines gps drew on. Without the write barrier, that's all of them.
+  frame_count++;
+  if (!dirty_tracking)
+    memset(dirty_lines, 1, lines);
+#ifdef GPS_PACKED_CELLS
+  for (int line = 0; line < lines; line++)
+    if (dirty_lines[line])
+      planes_stamp[line] = frame_count;
+  // These cells were packed some frames ago; catch up on what changed since
+  for (int line = 0; line < lines; line++) {
+    if (f.line_stamp[line] != planes_stamp[line]) {
+      pack_cells(f.cells, line * line_len, (line + 1) * line_len);
+      f.line_stamp[line] = planes_stamp[line];
+    }
+  }
+#else
+  for (int line = 0; line < lines; line++) {
+    if (dirty_lines[line]) {
+      f.line_stamp[line] = newest_stamp[line] = frame_count;
+      newest_frame[line] = drawing;
+    }
+  }
+  (void)line_len;
+#endif
+  memset(dirty_lines, 0, lines);
+
+  f.full = gps.force_full_display_count > 0;
+  if (f.full) gps.force_full_display_count--;
+  f.ttf_retired = ttf_manager.retired();
+
+  const int prev = ready.exchange(drawing | FRAME_FRESH);
+  draw_frame(prev & ~FRAME_FRESH);
+#ifndef GPS_PACKED_CELLS
+  // Without the write barrier every line gets a new stamp each frame, so
+  // there's never anything to catch up on; the game redraws it all.
+  if (dirty_tracking)
+    catch_up_frame(drawing);
+#endif
+  // If the main thread never took the previous frame, its request for a
+  // full display carries over to the next one.
+  if ((prev & FRAME_FRESH) && frames[drawing].full)
+    gps.force_full_display_count++;
+}
+
+bool renderer::take_frame() {
+  if (!(ready.load() & FRAME_FRESH))
+    return false;
+  // Only this thread clears FRAME_FRESH, so there is still a fresh frame to
+  // take; maybe a newer one than we just saw.
+  const int cur = ready.exchange(shown_old) & ~FRAME_FRESH;
+  show_frame(cur, shown);
+  ttf_manager.release_retired(frames[cur].ttf_retired);
+  return true;
+}
+
+#ifndef GPS_PACKED_CELLS
+// Copies into frames[index] every line some other frame got a newer stamp
+// for, so that a line with the same stamp in two frames is the same in
+// both. The frames copied from are only ever read by the main thread.
+void renderer::catch_up_frame(int index) {
+  const int lines = gps.line_count(), line_len = gps.dimx * gps.dimy / lines;
+  gps_frame &f = frames[index];
+  for (int line = 0; line < lines; line++) {
+    if (f.line_stamp[line] == newest_stamp[line]) continue;
+    const gps_frame &src = frames[newest_frame[line]];
+    const int begin = line * line_len;
+    memcpy(f.screen + begin*4, src.screen + begin*4, line_len*4);
+    memcpy(f.screentexpos + begin, src.screentexpos + begin, line_len*sizeof(long));
+    memcpy(f.screentexpos_addcolor + begin, src.screentexpos_addcolor + begin, line_len);
+    memcpy(f.screentexpos_grayscale + begin, src.screentexpos_grayscale + begin, line_len);
+    memcpy(f.screentexpos_cf + begin, src.screentexpos_cf + begin, line_len);
+    memcpy(f.screentexpos_cbr + begin, src.screentexpos_cbr + begin, line_len);
+    f.line_stamp[line] = newest_stamp[line];
+  }
+}
+#endif
+
+#ifdef GPS_PACKED_CELLS
+void renderer::pack_cells(tile_cell *dst, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    tile_cell &c = dst[i];
+    memcpy(c.screen, screen + i*4, 4);
+    c.texpos = screentexpos[i];
+    c.addcolor = screentexpos_addcolor[i];
+    c.grayscale = screentexpos_grayscale[i];
+    c.cf = screentexpos_cf[i];
+    c.cbr = screentexpos_cbr[i];
+  }
+}
+#endif
+
 void enablerst::pause_async_loop()  {
   struct async_cmd cmd;
   cmd.cmd = async_cmd::pause;
@@ -236,50 +453,74 @@ void enablerst::pause_async_loop()  {
   async_wait();
 }
 
+void enablerst::unpause_async_loop() {
+  // Full displays asked for while the loop was paused go out with the next
+  // frame it draws, but there may be one already waiting for us.
+  if (gps.force_full_display_count)
+    renderer->force_display_all();
+  struct async_cmd cmd;
+  cmd.cmd = async_cmd::start;
+  async_tobox.write(cmd);
+}
+
+// Acts on one message from the simulation thread
+void enablerst::async_handle(const async_msg &r) {
+  switch (r.msg) {
+  case async_msg::quit:
+    loopvar = 0;
+    break;
+  case async_msg::rendered:
+    render_pending = false;
+    // Fall through
+  case async_msg::complete:
+    if (textures_stale) {
+      if (textures.update_textures() && renderer)
+        renderer->force_display_all();
+      textures_stale = false;
+    }
+    break;
+  case async_msg::set_fps:
+    set_fps(r.fps);
+    async_fromcomplete.write();
+    break;
+  case async_msg::set_gfps:
+    set_gfps(r.fps);
+    async_fromcomplete.write();
+    break;
+  case async_msg::push_resize:
+    override_grid_size(r.x, r.y);
+    async_fromcomplete.write();
+    break;
+  case async_msg::pop_resize:
+    release_grid_size();
+    async_fromcomplete.write();
+    break;
+  case async_msg::reset_textures:
+    textures_stale = true;
+    break;
+  default:
+    puts("EMERGENCY: Unknown case in async_handle");
+    abort();
+  }
+}
+
 // Wait until the previous command has been acknowledged, /or/
 // async_loop has quit. Incidentally execute any requests in the
 // meantime.
-void enablerst::async_wait() {
+void enablerst::async_wait(async_msg::msg_t until) {
   if (loopvar == 0) return;
   async_msg r;
-  bool reset_textures = false;
-  for (;;) {
+  do {
     async_frombox.read(r);
-    switch (r.msg) {
-    case async_msg::quit:
-      loopvar = 0;
-      return;
-    case async_msg::complete:
-      if (reset_textures) {
-        puts("Resetting textures");
-        textures.remove_uploaded_textures();
-        textures.upload_textures();
-      }
-      return;
-    case async_msg::set_fps:
-      set_fps(r.fps);
-      async_fromcomplete.write();
-      break;
-    case async_msg::set_gfps:
-      set_gfps(r.fps);
-      async_fromcomplete.write();
-      break;
-    case async_msg::push_resize:
-      override_grid_size(r.x, r.y);
-      async_fromcomplete.write();
-      break;
-    case async_msg::pop_resize:
-      release_grid_size();
-      async_fromcomplete.write();
-      break;
-    case async_msg::reset_textures:
-      reset_textures = true;
-      break;
-    default:
-      puts("EMERGENCY: Unknown case in async_wait");
-      abort();
-    }
-  }
+    async_handle(r);
+  } while (r.msg != until && r.msg != async_msg::quit);
+}
+
+// Executes any requests from the simulation thread, without waiting
+void enablerst::async_poll() {
+  async_msg r;
+  while (loopvar && async_frombox.try_read(r))
+    async_handle(r);
 }
 
 void enablerst::async_loop() {
@@ -313,14 +554,15 @@ void enablerst::async_loop() {
         case async_cmd::render:
           if (flag & ENABLERFLAG_RENDER) {
             total_frames++;
-            renderer->swap_arrays();
             if (total_frames % 1800 == 0)
               ttf_manager.gc();
             render_things();
+            renderer->publish_frame();
             flag &= ~ENABLERFLAG_RENDER;
             update_gfps();
           }
-          async_frombox.write(async_msg(async_msg::complete));
+          // Nobody waits on this; the frame itself goes through the renderer
+          async_frombox.write(async_msg(async_msg::rendered));
           break;
         case async_cmd::inc:
           async_frames += cmd.val;
@@ -349,7 +591,16 @@ void enablerst::async_loop() {
   }
 }
 
+// Asks the async-loop to render_things, if it has anything new to show
+void enablerst::request_frame() {
+  async_tobox.write(async_cmd(async_cmd::render));
+  render_pending = true;
+}
+
 void enablerst::do_frame() {
+  // Handle whatever the async-loop sent since last frame
+  async_poll();
+
   // Check how long it's been, exactly
   const Uint32 now = SDL_GetTicks();
   const Uint32 interval = CLAMP(now - last_tick, 0, 1000); // Anything above a second doesn't count
@@ -376,15 +627,24 @@ void enablerst::do_frame() {
   enabler.clock = SDL_GetTicks();
 
   // If it's time to render..
-  if (outstanding_gframes >= 1 &&
-      (!sync || glClientWaitSync(sync, 0, 0) == GL_ALREADY_SIGNALED)) {
-    // Get the async-loop to render_things
-    async_cmd cmd(async_cmd::render);
-    async_tobox.write(cmd);
-    async_wait();
+  // If the GPU is too far behind, give it up to a gframe to catch up
+  // before skipping this one
+  if (outstanding_gframes >= 1 && frame_slot_free(1000 / gfps)) {
+    // Frames are asked for one ahead, so usually the async-loop has drawn
+    // one while we were busy. Only wait if it hasn't got to it yet.
+    if (!render_pending)
+      request_frame();
+    bool fresh = renderer->take_frame();
+    if (!fresh && render_pending) {
+      async_wait(async_msg::rendered);
+      fresh = renderer->take_frame();
+    }
     // Then finish here
-    renderer->display();
+    if (fresh)
+      renderer->display();
     renderer->render();
+    if (!render_pending)
+      request_frame();
     gputicks.lock();
     gputicks.val++;
     gputicks.unlock();
@@ -400,6 +660,101 @@ void enablerst::do_frame() {
   }
 }
 
+// The program cache's hash, of the sources and the driver, as cache_key
+// alone won't tell one driver's binaries from another's
+static uint64_t program_hash(const string &cache_key) {
+  string driver;
+  const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+  for (int i = 0; i < 3; i++) {
+    const GLubyte *str = glGetString(strings[i]);
+    if (str) driver += (const char*)str;
+    driver += '\n';
+  }
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  const string all = driver + cache_key;
+  for (size_t i = 0; i < all.size(); i++) {
+    hash ^= (unsigned char)all[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static string program_cache_file(const string &name) {
+  return "data/shader_cache/" + name + ".bin";
+}
+
+GLuint shader::load_program(const string &name, const string &cache_key) {
+  if (!GLEW_ARB_get_program_binary) return 0;
+  std::ifstream file(program_cache_file(name).c_str(), std::ios::binary);
+  uint64_t hash;
+  GLenum format;
+  if (!file.read((char*)&hash, sizeof(hash)) || hash != program_hash(cache_key) ||
+      !file.read((char*)&format, sizeof(format)))
+    return 0;
+  vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (binary.empty()) return 0;
+  GLuint program = glCreateProgram();
+  glProgramBinary(program, format, &binary[0], binary.size());
+  GLint status;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (status == GL_FALSE) {
+    // A driver update, most likely; it gets compiled and cached again
+    glDeleteProgram(program);
+    return 0;
+  }
+  printGLError();
+  return program;
+}
+
+void shader::store_program(GLuint program, const string &name, const string &cache_key) {
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0) return;
+  vector<char> binary(length);
+  GLenum format;
+  glGetProgramBinary(program, length, NULL, &format, &binary[0]);
+  printGLError();
+  CreateDirectory("data", NULL);
+  CreateDirectory("data/shader_cache", NULL);
+  std::ofstream file(program_cache_file(name).c_str(), std::ios::binary | std::ios::trunc);
+  const uint64_t hash = program_hash(cache_key);
+  file.write((const char*)&hash, sizeof(hash));
+  file.write((const char*)&format, sizeof(format));
+  file.write(&binary[0], binary.size());
+}
+
+void enablerst::fence_frame() {
+  if (!init.display.flag.has_flag(INIT_DISPLAY_FLAG_ARB_SYNC) || !GLEW_ARB_sync)
+    return;
+  frame_fences.push_back(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+  sync = frame_fences.front();
+}
+
+bool enablerst::frame_slot_free(Uint32 timeout_ms) {
+  while (!frame_fences.empty()) {
+    const bool full = frame_fences.size() >= init_tuning.frames_in_flight;
+    const GLuint64 timeout = full ? GLuint64(timeout_ms) * 1000000 : 0;
+    if (glClientWaitSync(frame_fences.front(), GL_SYNC_FLUSH_COMMANDS_BIT, timeout) ==
+        GL_TIMEOUT_EXPIRED) {
+      if (full) return false;
+      break;
+    }
+    // Signaled, or the wait failed; either way, it's done with
+    glDeleteSync(frame_fences.front());
+    frame_fences.pop_front();
+  }
+  sync = frame_fences.empty() ? NULL : frame_fences.front();
+  return true;
+}
+
+void enablerst::release_fences() {
+  for (size_t i = 0; i < frame_fences.size(); i++)
+    glDeleteSync(frame_fences[i]);
+  frame_fences.clear();
+  sync = NULL;
+}
+
 void enablerst::eventLoop_SDL()
 {
   
@@ -570,6 +925,10 @@ int enablerst::loop(string cmdline) {
       renderer = new renderer_partial();
     else
       renderer = new renderer_once();
+  } else if (init.display.flag.has_flag(INIT_DISPLAY_FLAG_SHADER)) {
+    renderer = new renderer_shader();
+  } else if (init.display.flag.has_flag(INIT_DISPLAY_FLAG_INSTANCED)) {
+    renderer = new renderer_instanced();
   } else if (init.display.flag.has_flag(INIT_DISPLAY_FLAG_VBO)) {
     renderer = new renderer_vbo();
   } else {
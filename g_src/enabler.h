@@ -18,6 +18,7 @@
 #include <queue>
 #include <set>
 #include <functional>
+#include <atomic>
 
 using std::vector;
 using std::pair;
@@ -45,6 +46,7 @@ using std::queue;
 #include "files.h"
 #include "enabler_input.h"
 #include "mail.hpp"
+#include "tile_diff.h"
 
 #define ENABLER
 
@@ -407,12 +409,18 @@ class texture_bo {
       printGLError();
     }
   }
-  void buffer(GLvoid *ptr, GLsizeiptr sz) {
+  void buffer(GLvoid *ptr, GLsizeiptr sz, GLenum usage = GL_STATIC_DRAW_ARB) {
     if (bo) reset();
     glGenBuffersARB(1, &bo);
     glGenTextures(1, &tbo);
     glBindBufferARB(GL_TEXTURE_BUFFER_ARB, bo);
-    glBufferDataARB(GL_TEXTURE_BUFFER_ARB, sz, ptr, GL_STATIC_DRAW_ARB);
+    glBufferDataARB(GL_TEXTURE_BUFFER_ARB, sz, ptr, usage);
+    printGLError();
+  }
+  // Overwrites part of the buffer
+  void update(GLintptr offset, GLsizeiptr sz, const GLvoid *ptr) {
+    glBindBufferARB(GL_TEXTURE_BUFFER_ARB, bo);
+    glBufferSubDataARB(GL_TEXTURE_BUFFER_ARB, offset, sz, ptr);
     printGLError();
   }
   void bind(GLenum texture_unit, GLenum type) {
@@ -430,9 +438,8 @@ class shader {
   std::ostringstream lines;
  public:
   std::ostringstream header;
-  void load(const string &filename) {
+  void load(std::istream &file, const string &filename) {
     this->filename = filename;
-    std::ifstream file(filename.c_str());
     string version;
     getline(file, version);
     header << version << std::endl;
@@ -441,9 +448,23 @@ class shader {
       getline(file, line);
       lines << line << std::endl;
     }
+  }
+  void load(const string &filename) {
+    std::ifstream file(filename.c_str());
+    load(file, filename);
     file.close();
   }
-  GLuint upload(GLenum type) {
+  // For shaders compiled into the executable; name is only for the logs
+  void load_source(const string &name, const char *source) {
+    std::istringstream file(source);
+    load(file, name);
+  }
+  // Everything upload() compiles; for the program cache's key
+  string source() const {
+    return header.str() + "#line 1 0\n" + lines.str();
+  }
+  // If fatal is false, a shader that won't compile is logged and 0 returned
+  GLuint upload(GLenum type, bool fatal = true) {
     GLuint shader = glCreateShader(type);
     string lines_done = lines.str(), header_done = header.str();
     const char *ptrs[3];
@@ -470,14 +491,132 @@ class shader {
       std::cerr << buf << std::endl;
       //errorlog.flush();
       delete[] buf;
+      if (!fatal) {
+        glDeleteShader(shader);
+        return 0;
+      }
       MessageBox(NULL, "Shader compilation failed; details in errorlog.txt", "Critical error", MB_OK);
       abort();
     }
     printGLError();
     return shader;
   }
+  // Links a program whose shaders are attached and attributes bound.
+  // Returns false, after logging why, if that fails. If cache_key is
+  // given, the program binary is cached for load_program.
+  static bool link(GLuint program, const string &name, const string &cache_key = string()) {
+    const bool cache = !cache_key.empty() && GLEW_ARB_get_program_binary;
+    if (cache)
+      glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE) {
+      GLint log_size;
+      glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_size);
+      std::cerr << name << " program link log (" << log_size << "):" << std::endl;
+      char *buf = new char[log_size];
+      glGetProgramInfoLog(program, log_size, NULL, buf);
+      std::cerr << buf << std::endl;
+      delete[] buf;
+      return false;
+    }
+    if (cache) store_program(program, name, cache_key);
+    printGLError();
+    return true;
+  }
+  // Program binaries are kept in data/shader_cache, one per program name,
+  // along with a hash of the sources they were built from and the driver
+  // that built them. load_program returns a linked program if there's a
+  // binary that matches and the driver takes it back, or else 0.
+  static GLuint load_program(const string &name, const string &cache_key);
+  static void store_program(GLuint program, const string &name, const string &cache_key);
 };
 
+// Shadows the GL state the renderers set over and over, every frame, and
+// skips the calls that wouldn't change it. Everything that touches that
+// state must come through here; invalidate() forgets it all, for a new
+// context.
+class gl_state_cache {
+  enum { blend, alpha_test, texture_2d, vertex_array, color_array,
+         texture_coord_array, secondary_color_array, tracked };
+  signed char on[tracked]; // -1 if not known
+  GLenum blend_src, blend_dst, alpha_test_func;
+  GLclampf alpha_test_ref;
+  GLuint program;
+  unsigned long elided;
+
+  static int index(GLenum e) {
+    switch (e) {
+    case GL_BLEND: return blend;
+    case GL_ALPHA_TEST: return alpha_test;
+    case GL_TEXTURE_2D: return texture_2d;
+    case GL_VERTEX_ARRAY: return vertex_array;
+    case GL_COLOR_ARRAY: return color_array;
+    case GL_TEXTURE_COORD_ARRAY: return texture_coord_array;
+    case GL_SECONDARY_COLOR_ARRAY: return secondary_color_array;
+    default: return -1;
+    }
+  }
+  // False if e is known to be in that state already
+  bool change(GLenum e, bool state) {
+    const int i = index(e);
+    if (i < 0) return true;
+    if (on[i] == state) {
+      elided++;
+      return false;
+    }
+    on[i] = state;
+    return true;
+  }
+ public:
+  void enable(GLenum cap) { if (change(cap, true)) glEnable(cap); }
+  void disable(GLenum cap) { if (change(cap, false)) glDisable(cap); }
+  void enable_client(GLenum array) { if (change(array, true)) glEnableClientState(array); }
+  void disable_client(GLenum array) { if (change(array, false)) glDisableClientState(array); }
+  void blend_func(GLenum src, GLenum dst) {
+    if (blend_src == src && blend_dst == dst) {
+      elided++;
+      return;
+    }
+    blend_src = src;
+    blend_dst = dst;
+    glBlendFunc(src, dst);
+  }
+  void alpha_func(GLenum func, GLclampf ref) {
+    if (alpha_test_func == func && alpha_test_ref == ref) {
+      elided++;
+      return;
+    }
+    alpha_test_func = func;
+    alpha_test_ref = ref;
+    glAlphaFunc(func, ref);
+  }
+  void use_program(GLuint program) {
+    if (this->program == program) {
+      elided++;
+      return;
+    }
+    this->program = program;
+    glUseProgram(program);
+  }
+  void invalidate() {
+    memset(on, -1, sizeof(on));
+    // Not valid values, so the next call goes through
+    blend_src = blend_dst = alpha_test_func = GL_NONE;
+    alpha_test_ref = -1;
+    program = ~0u;
+  }
+  // Calls skipped so far, as they wouldn't have changed anything
+  unsigned long elided_calls() const { return elided; }
+
+  gl_state_cache() {
+    elided = 0;
+    invalidate();
+  }
+};
+extern gl_state_cache gl_state;
+
 
 class text_info_elementst
 {
@@ -752,6 +891,11 @@ class textures
   vector<SDL_Surface *> raws;
   bool uploaded;
   long add_texture(SDL_Surface*);
+  // Notes that a texture needs uploading again
+  void mark_changed(long pos);
+  // The layered catalog's halves of upload_textures and update_textures
+  bool upload_layers();
+  bool update_layers(const vector<bool> &changed);
  protected:
   GLuint gl_catalog; // texture catalog gennum
   struct gl_texpos *gl_texpos; // Texture positions in the GL catalog, if any
@@ -773,6 +917,23 @@ class textures
   // is automatically reflected in the uploaded copy - eg. it's replaced.
   // This is very expensive in opengl mode. Don't do it often.
   void upload_textures();
+  // Brings the uploaded catalog up to date with textures added, altered or
+  // deleted since, in place where possible. Returns true if any texture
+  // coordinates changed, so tiles drawn with the old ones are wrong.
+  bool update_textures();
+  // Changes whenever gl_texpos does
+  unsigned int catalog_generation();
+  // Entries in gl_texpos; may lag textureCount() until the next update
+  long catalog_count();
+  // Lets the catalog be a GL_TEXTURE_2D_ARRAY, for renderers that sample it
+  // from shaders. If the textures are all one size, each gets a layer of
+  // its own, indexed by texture position, and gl_texpos is left empty;
+  // otherwise they're packed into layer 0 as usual.
+  void use_layers(bool layers);
+  // True if the catalog has a layer per texture position
+  bool catalog_layered();
+  // What gl_catalog should be bound to
+  GLenum catalog_target();
   // Also, you really should try to remove uploaded textures before
   // deleting a window, in case of driver memory leaks.
   void remove_uploaded_textures();
@@ -818,43 +979,110 @@ typedef struct {									// Contains Information Vital To A Window
 enum zoom_commands { zoom_in, zoom_out, zoom_reset, zoom_fullscreen, zoom_resetgrid };
 
 
+// Palette entries past the 16 curses colors, for untinted graphics tiles
+#define PALETTE_WHITE 16
+#define PALETTE_BLACK 17
+
 struct texture_fullid {
   int texpos;
-  float r, g, b;
-  float br, bg, bb;
+  unsigned char fg, bg; // Palette indices; see enablerst::palette_color
 
   bool operator< (const struct texture_fullid &other) const {
     if (texpos != other.texpos) return texpos < other.texpos;
-    if (r != other.r) return r < other.r;
-    if (g != other.g) return g < other.g;
-    if (b != other.b) return b < other.b;
-    if (br != other.br) return br < other.br;
-    if (bg != other.bg) return bg < other.bg;
-    return bb < other.bb;
+    if (fg != other.fg) return fg < other.fg;
+    return bg < other.bg;
+  }
+  bool operator== (const struct texture_fullid &other) const {
+    return texpos == other.texpos && fg == other.fg && bg == other.bg;
   }
 };
 
+namespace std {
+  template<> struct hash<texture_fullid> {
+    size_t operator()(const texture_fullid &id) const {
+      return hash<uint64_t>()(((uint64_t)(unsigned)id.texpos << 16) | (id.fg << 8) | id.bg);
+    }
+  };
+}
+
 typedef int texture_ttfid; // Just the texpos
 
+// Everything gps draws a frame into. The renderer keeps four of them and
+// hands them between the threads: the one the simulation thread is drawing,
+// the newest finished one, and the current and previous ones on display.
+struct gps_frame {
+#ifdef GPS_PACKED_CELLS
+  tile_cell *cells; // gps itself draws into a single set of planes
+#else
+  unsigned char *screen;
+  long *screentexpos;
+  char *screentexpos_addcolor;
+  unsigned char *screentexpos_grayscale;
+  unsigned char *screentexpos_cf;
+  unsigned char *screentexpos_cbr;
+#endif
+  // The frame number each line was last drawn in. A line with the same
+  // stamp in two frames is the same in both.
+  uint32_t *line_stamp;
+  bool full;       // gps asked for a full display
+  int ttf_retired; // ttf_manager.retired() when it was published
+};
+
 class renderer {
   void cleanup_arrays();
+  gps_frame frames[4];
+  int drawing;           // Index of the frame gps draws into; simulation thread only
+  int shown, shown_old;  // Frames on display; main thread only
+  std::atomic<int> ready; // The spare frame, or'd with FRAME_FRESH if it was published since
+  uint32_t frame_count;  // Stamp for the frame being drawn
+  bool display_all;      // Main thread asked for a full display
+  enum { FRAME_FRESH = 4 };
+  void draw_frame(int index);
+  void show_frame(int cur, int old);
  protected:
+  // The frame on display
   unsigned char *screen;
   long *screentexpos;
   char *screentexpos_addcolor;
   unsigned char *screentexpos_grayscale;
   unsigned char *screentexpos_cf;
   unsigned char *screentexpos_cbr;
-  // For partial printing:
+  // For partial printing: the one displayed before it
   unsigned char *screen_old;
   long *screentexpos_old;
   char *screentexpos_addcolor_old;
   unsigned char *screentexpos_grayscale_old;
   unsigned char *screentexpos_cf_old;
   unsigned char *screentexpos_cbr_old;
+  // One bit per tile, set by display() for tiles that differ from _old
+  uint32_t *tile_dirty;
+  // Lines gps wrote to since the last publish_frame; see graphicst::dirty_lines
+  unsigned char *dirty_lines;
+  // The line_stamp of the two frames on display
+  uint32_t *line_stamp;
+  uint32_t *line_stamp_old;
+#ifdef GPS_PACKED_CELLS
+  // The frame on display, packed, and the one before it. The planes above
+  // are then a single set, owned here and drawn into by gps; the _old ones
+  // are unused.
+  tile_cell *cells;
+  tile_cell *cells_old;
+  uint32_t *planes_stamp; // line_stamp of the planes
+  void pack_cells(tile_cell *dst, int begin, int end);
+#else
+  // The newest stamp of each line, and the frame that got it. With
+  // DIRTY_TRACKING, publish_frame copies newer lines into the next frame
+  // before gps draws on it, as gps only redraws what it writes.
+  uint32_t *newest_stamp;
+  unsigned char *newest_frame;
+  void catch_up_frame(int index);
+#endif
 
   void gps_allocate(int x, int y);
   Either<texture_fullid,texture_ttfid> screen_to_texid(int x, int y);
+  const unsigned char *tile_screen(int x, int y);
+  void for_each_dirty_run(void (renderer::*fn)(int, int));
+  void update_changed(int begin, int end);
  public:
   void display();
   virtual void update_tile(int x, int y) = 0;
@@ -864,8 +1092,22 @@ class renderer {
   virtual void zoom(zoom_commands cmd) {};
   virtual void resize(int w, int h) = 0;
   virtual void grid_resize(int w, int h) = 0;
-  void swap_arrays();
+  // Simulation thread, after render_things: passes the frame gps drew on
+  // to the main thread, and points gps at another one.
+  void publish_frame();
+  // Main thread: puts the newest published frame on display. Returns false
+  // if there is none since the last call.
+  bool take_frame();
+  // Main thread: makes the next display() an update_all()
+  void force_display_all() { display_all = true; }
   renderer() {
+    memset(frames, 0, sizeof(frames));
+    drawing = 0;
+    ready = 1;
+    shown = 2;
+    shown_old = 3;
+    frame_count = 0;
+    display_all = false;
     screen = NULL;
     screentexpos = NULL;
     screentexpos_addcolor = NULL;
@@ -878,6 +1120,18 @@ class renderer {
     screentexpos_grayscale_old = NULL;
     screentexpos_cf_old = NULL;
     screentexpos_cbr_old = NULL;
+    tile_dirty = NULL;
+    dirty_lines = NULL;
+    line_stamp = NULL;
+    line_stamp_old = NULL;
+#ifdef GPS_PACKED_CELLS
+    cells = NULL;
+    cells_old = NULL;
+    planes_stamp = NULL;
+#else
+    newest_stamp = NULL;
+    newest_frame = NULL;
+#endif
   }
   virtual ~renderer() {
     cleanup_arrays();
@@ -931,7 +1185,7 @@ class enablerst : public enabler_inputst
   };
 
   struct async_msg {
-    enum msg_t { quit, complete, set_fps, set_gfps, push_resize, pop_resize, reset_textures } msg;
+    enum msg_t { quit, complete, set_fps, set_gfps, push_resize, pop_resize, reset_textures, rendered } msg;
     union {
       int fps; // set_fps, set_gfps
       struct { // push_resize
@@ -953,18 +1207,23 @@ class enablerst : public enabler_inputst
  private:
 
   void pause_async_loop();
-  void async_wait();
-  void unpause_async_loop() {
-    struct async_cmd cmd;
-    cmd.cmd = async_cmd::start;
-    async_tobox.write(cmd);
-  }
+  void async_wait(async_msg::msg_t until = async_msg::complete);
+  void async_poll();
+  void async_handle(const async_msg &r);
+  void unpause_async_loop();
+  void request_frame();
   
  public:
 
   string command_line;
 
   float ccolor[16][3]; // The curses-RGB mapping used for non-curses display modes
+  // Resolves a texture_fullid palette index to RGB
+  const float *palette_color(int index) const {
+    static const float white[3] = {1, 1, 1}, black[3] = {0, 0, 0};
+    if (index < 16) return ccolor[index];
+    return index == PALETTE_WHITE ? white : black;
+  }
   
   enablerst();
   unsigned long flag; // ENABLERFLAG_RENDER, ENABLERFLAG_MAXFPS
@@ -987,7 +1246,15 @@ class enablerst : public enabler_inputst
 
   // OpenGL state (wrappers)
   class textures textures; // Font/graphics texture catalog
-  GLsync sync; // Rendering barrier
+  GLsync sync; // Rendering barrier; the oldest frame still on the GPU
+  // Fences the frame just drawn, if ARB_SYNC is on
+  void fence_frame();
+  // Retires the fences of frames the GPU has finished. True if another
+  // frame may be drawn: fewer than FRAMES_IN_FLIGHT are still on the GPU,
+  // or the oldest of them finishes within timeout_ms.
+  bool frame_slot_free(Uint32 timeout_ms);
+  // Drops all fences; for when the GL context goes away
+  void release_fences();
   void reset_textures() {
     async_frombox.write(async_msg(async_msg::reset_textures));
   }
@@ -1015,6 +1282,9 @@ class enablerst : public enabler_inputst
   // TOADY: MOVE THESE TO "FRAMERATE INTERFACE"
   MVar<int> simticks, gputicks;
   Uint32 clock; // An *approximation* of the current time for use in garbage collection thingies, updated every frame or so.
+ private:
+  bool render_pending; // A render command is out, not yet answered by async_msg::rendered
+  bool textures_stale; // Got async_msg::reset_textures
 };
 #endif
 
@@ -19,11 +19,13 @@
 #define CLAMP(x,a,b) MIN(MAX((x),(a)),(b))
 #endif
 
-// GL error macro
+// GL error macro. Debug builds with KHR_debug get errors from a callback
+// as they happen, and don't poll; see gl_debug_output.
 extern int glerrorcount;
+extern bool gl_debug_output;
 
 #ifdef DEBUG
-# define printGLError() do { GLenum err; do { err = glGetError(); if (err && glerrorcount < 40) { printf("GL error: 0x%x in %s:%d\n", err, __FILE__ , __LINE__); glerrorcount++; } } while(err); } while(0);
+# define printGLError() do { GLenum err; if (!gl_debug_output) do { err = glGetError(); if (err && glerrorcount < 40) { printf("GL error: 0x%x in %s:%d\n", err, __FILE__ , __LINE__); glerrorcount++; } } while(err); } while(0);
 # define deputs(str) puts(str)
 #else
 # define printGLError()
@@ -244,14 +244,16 @@ void graphicst::addst(const string &str_orig, justification just, int space)
     const int offset = details.offset;
     int width = details.width;
     const int ourx = screenx + offset;
-    unsigned int * const s = ((unsigned int*)screen + ourx*dimy + screeny);
+    unsigned int * const s = ((unsigned int*)screen + tile_index(ourx, screeny));
     if (s < (unsigned int*)screen_limit)
       s[0] = (((unsigned int)GRAPHICSTYPE_TTF) << 24) | handle;
     // Also set the other tiles this text covers, but don't write past the end.
     if (width + ourx >= dimx)
       width = dimx - ourx - 1;
     for (int x = 1; x < width; ++x)
-      s[x * dimy] = (((unsigned int)GRAPHICSTYPE_TTFCONT) << 24) | handle;
+      s[x * tile_stride_x()] = (((unsigned int)GRAPHICSTYPE_TTFCONT) << 24) | handle;
+    for (int x = MAX(ourx, 0); x < MIN(ourx + MAX(width, 1), dimx); ++x)
+      mark_dirty(x, screeny);
     // Clean up, prepare for next string.
     screenx = ourx + width;
     ttfstr.clear();
@@ -288,6 +290,7 @@ void graphicst::erasescreen()
 	memset(screen, 0, dimx*dimy*4);
 
 	memset(screentexpos, 0, dimx*dimy*sizeof(long));
+	memset(dirty_lines, 1, line_count());
 }
 
 void graphicst::setclipping(long x1,long x2,long y1,long y2)
@@ -308,95 +311,96 @@ void graphicst::dim_colors(long x,long y,char dim)
 	if(x>=clipx[0]&&x<=clipx[1]&&
 		y>=clipy[0]&&y<=clipy[1])
 		{
+		mark_dirty(x, y);
 		switch(dim)
 			{
 			case 4:
-				switch(screen[x*dimy*4 + y*4 + 2])
+				switch(screen[tile_index(x, y)*4 + 2])
 					{
 					case 4:
 					case 5:
 					case 6:
-						screen[x*dimy*4 + y*4 + 2]=1;
+						screen[tile_index(x, y)*4 + 2]=1;
 						break;
 					case 2:
 					case 7:
-						screen[x*dimy*4 + y*4 + 2]=3;
+						screen[tile_index(x, y)*4 + 2]=3;
 						break;
 					}
-				switch(screen[x*dimy*4 + y*4 + 1])
+				switch(screen[tile_index(x, y)*4 + 1])
 					{
 					case 4:
 					case 5:
 					case 6:
-						screen[x*dimy*4 + y*4 + 1]=1;
+						screen[tile_index(x, y)*4 + 1]=1;
 						break;
 					case 2:
 					case 7:
-						screen[x*dimy*4 + y*4 + 1]=3;
+						screen[tile_index(x, y)*4 + 1]=3;
 						break;
 					}
-				if(screen[x*dimy*4 + y*4 + 1]==screen[x*dimy*4 + y*4 + 2])screen[x*dimy*4 + y*4 + 1]=0;
-				screen[x*dimy*4 + y*4 + 3]=0;
-				if(screen[x*dimy*4 + y*4 + 1]==0&&screen[x*dimy*4 + y*4 + 2]==0&&screen[x*dimy*4 + y*4 + 3]==0)screen[x*dimy*4 + y*4 + 3]=1;
+				if(screen[tile_index(x, y)*4 + 1]==screen[tile_index(x, y)*4 + 2])screen[tile_index(x, y)*4 + 1]=0;
+				screen[tile_index(x, y)*4 + 3]=0;
+				if(screen[tile_index(x, y)*4 + 1]==0&&screen[tile_index(x, y)*4 + 2]==0&&screen[tile_index(x, y)*4 + 3]==0)screen[tile_index(x, y)*4 + 3]=1;
 				break;
 			case 3:
-				switch(screen[x*dimy*4 + y*4 + 2])
+				switch(screen[tile_index(x, y)*4 + 2])
 					{
 					case 4:
 					case 5:
-						screen[x*dimy*4 + y*4 + 2]=6;
+						screen[tile_index(x, y)*4 + 2]=6;
 						break;
 					case 2:
 					case 7:
-						screen[x*dimy*4 + y*4 + 2]=3;
+						screen[tile_index(x, y)*4 + 2]=3;
 						break;
 					}
-				switch(screen[x*dimy*4 + y*4 + 1])
+				switch(screen[tile_index(x, y)*4 + 1])
 					{
 					case 1:
-						screen[x*dimy*4 + y*4 + 3]=0;
+						screen[tile_index(x, y)*4 + 3]=0;
 						break;
 					case 4:
 					case 5:
-						screen[x*dimy*4 + y*4 + 1]=6;
+						screen[tile_index(x, y)*4 + 1]=6;
 						break;
 					case 2:
-						screen[x*dimy*4 + y*4 + 1]=3;
+						screen[tile_index(x, y)*4 + 1]=3;
 						break;
 					case 7:
-						screen[x*dimy*4 + y*4 + 1]=3;
+						screen[tile_index(x, y)*4 + 1]=3;
 						break;
 					}
-				if(screen[x*dimy*4 + y*4 + 1]!=7)screen[x*dimy*4 + y*4 + 3]=0;
-				if(screen[x*dimy*4 + y*4 + 1]==screen[x*dimy*4 + y*4 + 2]&&
-					screen[x*dimy*4 + y*4 + 3]==0)screen[x*dimy*4 + y*4 + 1]=0;
-				if(screen[x*dimy*4 + y*4 + 1]==0&&screen[x*dimy*4 + y*4 + 2]==0&&screen[x*dimy*4 + y*4 + 3]==0)screen[x*dimy*4 + y*4 + 3]=1;
+				if(screen[tile_index(x, y)*4 + 1]!=7)screen[tile_index(x, y)*4 + 3]=0;
+				if(screen[tile_index(x, y)*4 + 1]==screen[tile_index(x, y)*4 + 2]&&
+					screen[tile_index(x, y)*4 + 3]==0)screen[tile_index(x, y)*4 + 1]=0;
+				if(screen[tile_index(x, y)*4 + 1]==0&&screen[tile_index(x, y)*4 + 2]==0&&screen[tile_index(x, y)*4 + 3]==0)screen[tile_index(x, y)*4 + 3]=1;
 				break;
 			case 2:
-				switch(screen[x*dimy*4 + y*4 + 2])
+				switch(screen[tile_index(x, y)*4 + 2])
 					{
 					case 4:
 					case 5:
-						screen[x*dimy*4 + y*4 + 2]=6;
+						screen[tile_index(x, y)*4 + 2]=6;
 						break;
 					}
-				switch(screen[x*dimy*4 + y*4 + 1])
+				switch(screen[tile_index(x, y)*4 + 1])
 					{
 					case 4:
 					case 5:
-						screen[x*dimy*4 + y*4 + 1]=6;
+						screen[tile_index(x, y)*4 + 1]=6;
 						break;
 					}
-				if(screen[x*dimy*4 + y*4 + 1]!=7)screen[x*dimy*4 + y*4 + 3]=0;
-				if(screen[x*dimy*4 + y*4 + 1]==screen[x*dimy*4 + y*4 + 2]&&
-					screen[x*dimy*4 + y*4 + 3]==0)screen[x*dimy*4 + y*4 + 1]=0;
-				if(screen[x*dimy*4 + y*4 + 1]==0&&screen[x*dimy*4 + y*4 + 2]==0&&screen[x*dimy*4 + y*4 + 3]==0)screen[x*dimy*4 + y*4 + 3]=1;
+				if(screen[tile_index(x, y)*4 + 1]!=7)screen[tile_index(x, y)*4 + 3]=0;
+				if(screen[tile_index(x, y)*4 + 1]==screen[tile_index(x, y)*4 + 2]&&
+					screen[tile_index(x, y)*4 + 3]==0)screen[tile_index(x, y)*4 + 1]=0;
+				if(screen[tile_index(x, y)*4 + 1]==0&&screen[tile_index(x, y)*4 + 2]==0&&screen[tile_index(x, y)*4 + 3]==0)screen[tile_index(x, y)*4 + 3]=1;
 				break;
 			case 1:
-				if(screen[x*dimy*4 + y*4 + 1]!=7)screen[x*dimy*4 + y*4 + 3]=0;
-				if(screen[x*dimy*4 + y*4 + 1]==screen[x*dimy*4 + y*4 + 2]&&
-					screen[x*dimy*4 + y*4 + 3]==0)screen[x*dimy*4 + y*4 + 1]=0;
-				if(screen[x*dimy*4 + y*4 + 1]==0&&screen[x*dimy*4 + y*4 + 2]==0&&screen[x*dimy*4 + y*4 + 3]==0)screen[x*dimy*4 + y*4 + 3]=1;
+				if(screen[tile_index(x, y)*4 + 1]!=7)screen[tile_index(x, y)*4 + 3]=0;
+				if(screen[tile_index(x, y)*4 + 1]==screen[tile_index(x, y)*4 + 2]&&
+					screen[tile_index(x, y)*4 + 3]==0)screen[tile_index(x, y)*4 + 1]=0;
+				if(screen[tile_index(x, y)*4 + 1]==0&&screen[tile_index(x, y)*4 + 2]==0&&screen[tile_index(x, y)*4 + 3]==0)screen[tile_index(x, y)*4 + 3]=1;
 				break;
 			}
 		}
@@ -407,9 +411,10 @@ void graphicst::rain_color_square(long x,long y)
 	if(x>=clipx[0]&&x<=clipx[1]&&
 		y>=clipy[0]&&y<=clipy[1])
 		{
-		screen[x*dimy*4 + y*4 + 1]=1;
-		screen[x*dimy*4 + y*4 + 2]=0;
-		screen[x*dimy*4 + y*4 + 3]=1;
+		mark_dirty(x, y);
+		screen[tile_index(x, y)*4 + 1]=1;
+		screen[tile_index(x, y)*4 + 2]=0;
+		screen[tile_index(x, y)*4 + 3]=1;
 		}
 }
 
@@ -418,9 +423,10 @@ void graphicst::snow_color_square(long x,long y)
 	if(x>=clipx[0]&&x<=clipx[1]&&
 		y>=clipy[0]&&y<=clipy[1])
 		{
-		screen[x*dimy*4 + y*4 + 1]=7;
-		screen[x*dimy*4 + y*4 + 2]=0;
-		screen[x*dimy*4 + y*4 + 3]=1;
+		mark_dirty(x, y);
+		screen[tile_index(x, y)*4 + 1]=7;
+		screen[tile_index(x, y)*4 + 2]=0;
+		screen[tile_index(x, y)*4 + 3]=1;
 		}
 }
 
@@ -429,9 +435,10 @@ void graphicst::color_square(long x,long y,unsigned char f,unsigned char b,unsig
 	if(x>=clipx[0]&&x<=clipx[1]&&
 		y>=clipy[0]&&y<=clipy[1])
 		{
-		screen[x*dimy*4 + y*4 + 1]=f;
-		screen[x*dimy*4 + y*4 + 2]=b;
-		screen[x*dimy*4 + y*4 + 3]=br;
+		mark_dirty(x, y);
+		screen[tile_index(x, y)*4 + 1]=f;
+		screen[tile_index(x, y)*4 + 2]=b;
+		screen[tile_index(x, y)*4 + 3]=br;
 		}
 }
 
@@ -483,9 +490,10 @@ void graphicst::add_tile(long texp,char addcolor)
 	if(screenx>=clipx[0]&&screenx<=clipx[1]&&
 		screeny>=clipy[0]&&screeny<=clipy[1])
 		{
-		screentexpos[screenx*dimy + screeny]=texp;
-		screentexpos_addcolor[screenx*dimy + screeny]=addcolor;
-		screentexpos_grayscale[screenx*dimy + screeny]=0;
+		mark_dirty(screenx, screeny);
+		screentexpos[tile_index(screenx, screeny)]=texp;
+		screentexpos_addcolor[tile_index(screenx, screeny)]=addcolor;
+		screentexpos_grayscale[tile_index(screenx, screeny)]=0;
 		}
 }
 
@@ -494,11 +502,12 @@ void graphicst::add_tile_grayscale(long texp,char cf,char cbr)
 	if(screenx>=clipx[0]&&screenx<=clipx[1]&&
 		screeny>=clipy[0]&&screeny<=clipy[1])
 		{
-		screentexpos[screenx*dimy + screeny]=texp;
-		screentexpos_addcolor[screenx*dimy + screeny]=0;
-		screentexpos_grayscale[screenx*dimy + screeny]=1;
-		screentexpos_cf[screenx*dimy + screeny]=cf;
-		screentexpos_cbr[screenx*dimy + screeny]=cbr;
+		mark_dirty(screenx, screeny);
+		screentexpos[tile_index(screenx, screeny)]=texp;
+		screentexpos_addcolor[tile_index(screenx, screeny)]=0;
+		screentexpos_grayscale[tile_index(screenx, screeny)]=1;
+		screentexpos_cf[tile_index(screenx, screeny)]=cf;
+		screentexpos_cbr[tile_index(screenx, screeny)]=cbr;
 		}
 }
 
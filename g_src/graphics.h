@@ -20,7 +20,8 @@ enum Texture
 /* screen array layout
  *
  *
- * X*Y tiles of 4 bytes each in column-major order (FIXME: This is inefficient! It should be row-major!)
+ * X*Y tiles of 4 bytes each in column-major order, or row-major when built with GPS_ROW_MAJOR.
+ * Go through graphicst::tile_index() rather than computing offsets by hand.
  * For each tile, byte 0 is the character, 1 is foreground color, 2 is bacground, and 3 denotes bold.
  *
  * As there are only 8 different colors and bold is a boolean, this leaves a lot of free space. Therefore,
@@ -71,6 +72,25 @@ class graphicst
 
                 int dimx, dimy;
 
+                // Tile addressing for the screen arrays. GPS_ROW_MAJOR must match
+                // whatever the game was built with, as it indexes gps.screen too.
+                // A "line" is one contiguous run of tiles: a column, or a row.
+#ifdef GPS_ROW_MAJOR
+                int tile_index(int x, int y) const { return y*dimx + x; }
+                int tile_x(int tile) const { return tile % dimx; }
+                int tile_y(int tile) const { return tile / dimx; }
+                int tile_stride_x() const { return 1; }
+                int line_of(int x, int y) const { return y; }
+                int line_count() const { return dimy; }
+#else
+                int tile_index(int x, int y) const { return x*dimy + y; }
+                int tile_x(int tile) const { return tile / dimy; }
+                int tile_y(int tile) const { return tile % dimy; }
+                int tile_stride_x() const { return dimy; }
+                int line_of(int x, int y) const { return x; }
+                int line_count() const { return dimx; }
+#endif
+
 		graphicst()
 			{
 			print_index=0;
@@ -85,6 +105,7 @@ class graphicst
                         screentexpos_cf = NULL;
                         screentexpos_cbr = NULL;
                         screen = NULL;
+                        dirty_lines = NULL;
                         }
 
                 void locate(long y,long x)
@@ -102,7 +123,7 @@ class graphicst
                 void addchar(unsigned char c,char advance=1)
                 {
                   /* assert (screen_limit == screen + dimy * dimx * 4); */
-                  unsigned char *s = screen + screenx*dimy*4 + screeny*4;
+                  unsigned char *s = screen + tile_index(screenx, screeny)*4;
                   if (s < screen_limit) {
 	if(screenx>=clipx[0]&&screenx<=clipx[1]&&
 		screeny>=clipy[0]&&screeny<=clipy[1])
@@ -111,7 +132,8 @@ class graphicst
                     *s++ = screenf;
                     *s++ = screenb;
                     *s++ = screenbright;
-                    screentexpos[screenx*dimy + screeny]=0;
+                    screentexpos[tile_index(screenx, screeny)]=0;
+                    mark_dirty(screenx, screeny);
 	}
                   }
                   screenx += advance;
@@ -119,7 +141,7 @@ class graphicst
                 void addchar(unsigned int x, unsigned int y, unsigned char c,
                              unsigned char f, unsigned char b, unsigned char bright) {
                   /* assert (screen_limit == screen + dimy * dimx * 4); */
-                  unsigned char *s = screen + x*dimy*4 + y*4;
+                  unsigned char *s = screen + tile_index(x, y)*4;
                   if (s >= screen && s < screen_limit) {
 	if(x>=clipx[0]&&x<=clipx[1]&&
 		y>=clipy[0]&&y<=clipy[1])
@@ -128,6 +150,7 @@ class graphicst
                     *s++ = f;
                     *s++ = b;
                     *s++ = bright;
+                    mark_dirty(x, y);
 	}
                   }
                 }
@@ -150,9 +173,10 @@ class graphicst
                     {
                       for(y=sy;y<=ey;y++)
                         {
-                          screen[x*dimy*4 + y*4 + 1]=0;
-                          screen[x*dimy*4 + y*4 + 2]=7;
-                          screen[x*dimy*4 + y*4 + 3]=0;
+                          screen[tile_index(x, y)*4 + 1]=0;
+                          screen[tile_index(x, y)*4 + 2]=7;
+                          screen[tile_index(x, y)*4 + 3]=0;
+                          mark_dirty(x, y);
                         }
                     }
                 }
@@ -183,6 +207,13 @@ class graphicst
                 // Instead of doing costly bounds-checking calculations, we cache the end
                 // of the arrays..
                 unsigned char *screen_limit;
+
+                // Write barrier: one byte per line, set by every helper above that
+                // writes to the screen arrays. The renderer clears it in publish_frame
+                // and, with DIRTY_TRACKING:YES, only diffs the marked lines. It is
+                // opt-in because code that pokes at gps.screen directly bypasses it.
+                unsigned char *dirty_lines;
+                void mark_dirty(long x, long y) { dirty_lines[line_of(x, y)] = 1; }
 };
 
 extern graphicst gps;
@@ -198,7 +229,7 @@ public:
     last_x = x;
   }
   bool is_free(int x) {
-    unsigned char c = gps.screen[x*gps.dimy*4 + y*4];
+    unsigned char c = gps.screen[gps.tile_index(x, y)*4];
     switch (c) {
     case 0:
     case 20:
@@ -37,6 +37,8 @@ using std::string;
 extern enablerst enabler;
 extern graphicst gps;
 
+init_tuningst init_tuning;
+
 init_displayst::init_displayst()
 {
 	flag.set_size_on_flag_num(INIT_DISPLAY_FLAGNUM);
@@ -193,6 +195,10 @@ void initst::begin()
                                           {
                                             display.flag.add_flag(INIT_DISPLAY_FLAG_SHADER);
                                           }
+                                        if(token2=="INSTANCED")
+                                          {
+                                            display.flag.add_flag(INIT_DISPLAY_FLAG_INSTANCED);
+                                          }
  					}
 
 				if(token=="SINGLE_BUFFER")
@@ -283,6 +289,19 @@ void initst::begin()
                                   if (token2 == "YES")
                                     display.flag.add_flag(INIT_DISPLAY_FLAG_ARB_SYNC);
                                 }
+                                if(token=="DIRTY_TRACKING") {
+                                  if (token2 == "YES")
+                                    display.flag.add_flag(INIT_DISPLAY_FLAG_DIRTY_TRACKING);
+                                }
+                                if(token=="RENDER_THREADS") {
+                                  init_tuning.render_threads=MAX(convert_string_to_long(token2),0);
+                                }
+                                if(token=="FRAMES_IN_FLIGHT") {
+                                  init_tuning.frames_in_flight=CLAMP(convert_string_to_long(token2),1,8);
+                                }
+                                if(token=="TILE_CACHE_MB") {
+                                  init_tuning.tile_cache_mb=MAX(convert_string_to_long(token2),1);
+                                }
 
 #ifdef WIN32
 				if(token=="PRIORITY")
@@ -48,6 +48,8 @@ enum InitDisplayFlag
         INIT_DISPLAY_FLAG_SHADER,
         INIT_DISPLAY_FLAG_NOT_RESIZABLE,
         INIT_DISPLAY_FLAG_ARB_SYNC,
+        INIT_DISPLAY_FLAG_DIRTY_TRACKING,
+        INIT_DISPLAY_FLAG_INSTANCED,
 	INIT_DISPLAY_FLAGNUM
 };
 
@@ -163,4 +165,23 @@ class initst
 
 extern initst init;
 
+// Performance knobs from init.txt. These live outside initst, as the game
+// owns that object and a new member would change its layout.
+class init_tuningst
+{
+ public:
+  int render_threads; // RENDER_THREADS, counting the main thread; 0 is one per core
+  int frames_in_flight; // FRAMES_IN_FLIGHT, frames the GPU may lag behind with ARB_SYNC
+  int tile_cache_mb; // TILE_CACHE_MB, memory the 2D print modes keep colored tiles in
+
+  init_tuningst()
+    {
+      render_threads = 0;
+      frames_in_flight = 2;
+      tile_cache_mb = 64;
+    }
+};
+
+extern init_tuningst init_tuning;
+
 #endif
@@ -1359,7 +1359,7 @@ void interfacest::handlemovie(char flushall)
 					{
 					for(y2=0;y2<init.display.grid_y;y2++)
 						{
-						supermoviebuffer[supermovie_pos]=gps.screen[x2*gps.dimy*4 + y2*4 + 0];
+						supermoviebuffer[supermovie_pos]=gps.screen[gps.tile_index(x2, y2)*4 + 0];
 
 						supermovie_pos++;
 						}
@@ -1369,9 +1369,9 @@ void interfacest::handlemovie(char flushall)
 					{
 					for(y2=0;y2<init.display.grid_y;y2++)
 						{
-						frame_col=gps.screen[x2*gps.dimy*4 + y2*4 + 1];
-						frame_col|=(gps.screen[x2*gps.dimy*4 + y2*4 + 2]<<3);
-						if(gps.screen[x2*gps.dimy*4 + y2*4 + 3])frame_col|=64;
+						frame_col=gps.screen[gps.tile_index(x2, y2)*4 + 1];
+						frame_col|=(gps.screen[gps.tile_index(x2, y2)*4 + 2]<<3);
+						if(gps.screen[gps.tile_index(x2, y2)*4 + 3])frame_col|=64;
 						supermoviebuffer[supermovie_pos]=frame_col;
 
 						supermovie_pos++;
@@ -2,16 +2,252 @@
 #include "init.h"
 #include "resize++.h"
 #include "ttf_manager.hpp"
+#include "tile_colorize.h"
+#include "worker_pool.hpp"
 
+#include <cstring>
 #include <iostream>
 using namespace std;
 
 void report_error(const char*, const char*);
 
+// Where tile_cache_table keeps its tiles: a few large display-format
+// surfaces, slab fashion. Each page is cut into a grid of equal cells for
+// one tile size; cells freed by eviction go on their page's free list for
+// the next tile of that size, and a page is released once it empties.
+class tile_atlas {
+public:
+  struct cell {
+    int page, index; // page < 0 for no cell
+    cell() : page(-1), index(0) {}
+  };
+
+private:
+  struct page {
+    SDL_Surface *surface; // NULL if released
+    int w, h;             // Cell size
+    int columns, cells;
+    vector<int> free;     // Cells holding no tile
+  };
+  vector<page> pages;
+  size_t bytes;
+
+  static size_t surface_bytes(SDL_Surface *s) { return size_t(s->pitch) * s->h; }
+
+public:
+  // Takes a free w*h cell, starting a new page if none is left, provided
+  // that fits budget. There's always room for the first page.
+  bool alloc(int w, int h, size_t budget, cell &c) {
+    for (size_t i = 0; i < pages.size(); i++) {
+      page &p = pages[i];
+      if (p.surface && p.w == w && p.h == h && !p.free.empty()) {
+        c.page = i;
+        c.index = p.free.back();
+        p.free.pop_back();
+        return true;
+      }
+    }
+    // Aim for about a megabyte a page, laid out near square
+    const int cells = CLAMP(int((1 << 20) / (size_t(w) * h * 4)), 1, 256);
+    int columns = 1;
+    while (columns * columns < cells) columns++;
+    const int rows = (cells + columns - 1) / columns;
+    if (bytes && bytes + size_t(columns) * w * rows * h * 4 > budget)
+      return false;
+    SDL_Surface *blank = SDL_CreateRGBSurface(SDL_SWSURFACE, columns * w, rows * h,
+                                              32, 0, 0, 0, 0);
+    SDL_Surface *surface = blank ? SDL_DisplayFormat(blank) : NULL;
+    if (surface)
+      SDL_FreeSurface(blank);
+    else
+      surface = blank; // No video mode to match; blits will convert
+    if (!surface) {
+      MessageBox (NULL, "Unable to create texture!", "Fatal error", MB_OK | MB_ICONEXCLAMATION);
+      abort();
+    }
+    size_t i = 0;
+    while (i < pages.size() && pages[i].surface) i++;
+    if (i == pages.size()) pages.push_back(page());
+    page &p = pages[i];
+    p.surface = surface;
+    p.w = w; p.h = h;
+    p.columns = columns;
+    p.cells = columns * rows;
+    // Hand the cells out in order, so a part-filled page stays compact
+    p.free.clear();
+    for (int k = p.cells - 1; k > 0; k--)
+      p.free.push_back(k);
+    c.page = i;
+    c.index = 0;
+    bytes += surface_bytes(surface);
+    return true;
+  }
+
+  void release(const cell &c) {
+    page &p = pages[c.page];
+    p.free.push_back(c.index);
+    if ((int)p.free.size() == p.cells) {
+      bytes -= surface_bytes(p.surface);
+      SDL_FreeSurface(p.surface);
+      p.surface = NULL;
+    }
+  }
+
+  // The page holding c, with rect set to c's place on it
+  SDL_Surface *locate(const cell &c, SDL_Rect &rect) const {
+    const page &p = pages[c.page];
+    rect.x = (c.index % p.columns) * p.w;
+    rect.y = (c.index / p.columns) * p.h;
+    rect.w = p.w;
+    rect.h = p.h;
+    return p.surface;
+  }
+
+  size_t size() const { return bytes; }
+
+  int page_count() const {
+    int n = 0;
+    for (size_t i = 0; i < pages.size(); i++)
+      if (pages[i].surface) n++;
+    return n;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < pages.size(); i++)
+      if (pages[i].surface) SDL_FreeSurface(pages[i].surface);
+    pages.clear();
+    bytes = 0;
+  }
+
+  tile_atlas() { bytes = 0; }
+  ~tile_atlas() { clear(); }
+};
+
+// Colored, scaled tiles for the 2D print modes, by texture_fullid. An open
+// addressing hash table of cells in a tile_atlas, held to TILE_CACHE_MB;
+// when that's used up, a CLOCK hand goes round the slots and evicts the
+// first tile that hasn't been drawn since it last passed.
+class tile_cache_table {
+  struct slot {
+    texture_fullid id;
+    tile_atlas::cell cell;
+    bool used;            // Looked up since the hand passed
+    bool empty() const { return cell.page < 0; }
+  };
+  vector<slot> slots; // A power of two of them, at most half full
+  tile_atlas atlas;
+  size_t count, hand;
+
+  size_t home(const texture_fullid &id) const {
+    const uint64_t key = ((uint64_t)(unsigned)id.texpos << 16) | (id.fg << 8) | id.bg;
+    return size_t((key * 0x9E3779B97F4A7C15ULL) >> 32) & (slots.size() - 1);
+  }
+
+  // The slot holding id, or the free slot it would go in
+  size_t probe(const texture_fullid &id) const {
+    size_t i = home(id);
+    while (!slots[i].empty() && !(slots[i].id == id))
+      i = (i + 1) & (slots.size() - 1);
+    return i;
+  }
+
+  void resize(size_t size) {
+    vector<slot> old(size);
+    old.swap(slots);
+    for (size_t i = 0; i < old.size(); i++)
+      if (!old[i].empty())
+        slots[probe(old[i].id)] = old[i];
+    hand = 0;
+  }
+
+  // Frees slot i, then shifts back whatever probed past it, so lookups
+  // never need tombstones
+  void erase(size_t i) {
+    const size_t mask = slots.size() - 1;
+    atlas.release(slots[i].cell);
+    count--;
+    for (size_t j = i;;) {
+      slots[i].cell = tile_atlas::cell();
+      size_t k;
+      do {
+        j = (j + 1) & mask;
+        if (slots[j].empty()) return;
+        k = home(slots[j].id);
+        // Slot j may stay if its home lies cyclically in (i, j]
+      } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+
+  void evict_one() {
+    for (;;) {
+      slot &s = slots[hand];
+      if (!s.empty()) {
+        if (!s.used) {
+          // Whatever shifts into this slot gets looked at next time
+          erase(hand);
+          evictions++;
+          return;
+        }
+        s.used = false;
+      }
+      hand = (hand + 1) & (slots.size() - 1);
+    }
+  }
+
+public:
+  unsigned long hits, misses, evictions;
+
+  // The atlas page holding id's tile, with src set to its place there
+  SDL_Surface *find(const texture_fullid &id, SDL_Rect &src) {
+    slot &s = slots[probe(id)];
+    if (s.empty()) {
+      misses++;
+      return NULL;
+    }
+    hits++;
+    s.used = true;
+    return atlas.locate(s.cell, src);
+  }
+
+  // Makes room for a w*h tile for id, which must not be cached yet, and
+  // returns the page it's to be drawn into, at dst
+  SDL_Surface *insert(const texture_fullid &id, int w, int h, SDL_Rect &dst) {
+    const size_t budget = size_t(init_tuning.tile_cache_mb) << 20;
+    tile_atlas::cell cell;
+    while (!atlas.alloc(w, h, budget, cell))
+      evict_one();
+    if ((count + 1) * 2 > slots.size())
+      resize(slots.size() * 2);
+    slot &s = slots[probe(id)];
+    s.id = id;
+    s.cell = cell;
+    s.used = true;
+    count++;
+    return atlas.locate(cell, dst);
+  }
+
+  size_t size() const { return atlas.size(); }
+  int pages() const { return atlas.page_count(); }
+
+  void clear() {
+    for (size_t i = 0; i < slots.size(); i++)
+      slots[i].cell = tile_atlas::cell();
+    atlas.clear();
+    count = hand = 0;
+  }
+
+  tile_cache_table() : slots(256) {
+    count = hand = 0;
+    hits = misses = evictions = 0;
+  }
+};
+
 class renderer_2d_base : public renderer {
 protected:
   SDL_Surface *screen;
-  map<texture_fullid, SDL_Surface*> tile_cache;
+  tile_cache_table tile_cache;
   int dispx, dispy, dimx, dimy;
   // We may shrink or enlarge dispx/dispy in response to zoom requests. dispx/y_z are the
   // size we actually display tiles at.
@@ -19,56 +255,62 @@ protected:
   // Viewport origin
   int origin_x, origin_y;
 
-  SDL_Surface *tile_cache_lookup(texture_fullid &id, bool convert=true) {
-    map<texture_fullid, SDL_Surface*>::iterator it = tile_cache.find(id);
-    if (it != tile_cache.end()) {
-      return it->second;
+  // Scratch surface tiles are colored in, before scaling into the atlas
+  SDL_Surface *colored;
+
+  // The atlas page holding id's tile, with src set to its place there
+  SDL_Surface *tile_cache_lookup(texture_fullid &id, SDL_Rect &src, bool convert=true) {
+    SDL_Surface *page = tile_cache.find(id, src);
+    if (page) {
+      return page;
     } else {
       // Create the colorized texture
       SDL_Surface *tex   = enabler.textures.get_texture_data(id.texpos);
-      SDL_Surface *color;
-      color = SDL_CreateRGBSurface(SDL_SWSURFACE,
-                                   tex->w, tex->h,
-                                   tex->format->BitsPerPixel,
-                                   tex->format->Rmask,
-                                   tex->format->Gmask,
-                                   tex->format->Bmask,
-                                   0);
-      if (!color) {
+      if (!colored || colored->w != tex->w || colored->h != tex->h ||
+          colored->format->BitsPerPixel != tex->format->BitsPerPixel ||
+          colored->format->Rmask != tex->format->Rmask ||
+          colored->format->Gmask != tex->format->Gmask ||
+          colored->format->Bmask != tex->format->Bmask) {
+        if (colored) SDL_FreeSurface(colored);
+        colored = SDL_CreateRGBSurface(SDL_SWSURFACE,
+                                       tex->w, tex->h,
+                                       tex->format->BitsPerPixel,
+                                       tex->format->Rmask,
+                                       tex->format->Gmask,
+                                       tex->format->Bmask,
+                                       0);
+      }
+      if (!colored) {
         MessageBox (NULL, "Unable to create texture!", "Fatal error", MB_OK | MB_ICONEXCLAMATION);
         abort();
       }
       
       // Fill it
-      Uint32 color_fgi = SDL_MapRGB(color->format, id.r*255, id.g*255, id.b*255);
-      Uint8 *color_fg = (Uint8*) &color_fgi;
-      Uint32 color_bgi = SDL_MapRGB(color->format, id.br*255, id.bg*255, id.bb*255);
-      Uint8 *color_bg = (Uint8*) &color_bgi;
+      const float *fgc = enabler.palette_color(id.fg), *bgc = enabler.palette_color(id.bg);
+      Uint32 color_fgi = SDL_MapRGB(colored->format, fgc[0]*255, fgc[1]*255, fgc[2]*255);
+      Uint32 color_bgi = SDL_MapRGB(colored->format, bgc[0]*255, bgc[1]*255, bgc[2]*255);
       SDL_LockSurface(tex);
-      SDL_LockSurface(color);
+      SDL_LockSurface(colored);
       
-      Uint8 *pixel_src, *pixel_dst;
-      for (int y = 0; y < tex->h; y++) {
-        pixel_src = ((Uint8*)tex->pixels) + (y * tex->pitch);
-        pixel_dst = ((Uint8*)color->pixels) + (y * color->pitch);
-        for (int x = 0; x < tex->w; x++, pixel_src+=4, pixel_dst+=4) {
-          float alpha = pixel_src[3] / 255.0;
-          for (int c = 0; c < 3; c++) {
-            float fg = color_fg[c] / 255.0, bg = color_bg[c] / 255.0, tex = pixel_src[c] / 255.0;
-            pixel_dst[c] = ((alpha * (tex * fg)) + ((1 - alpha) * bg)) * 255;
-          }
-        }
-      }
+      colorize_tile((Uint8*)tex->pixels, tex->pitch, (Uint8*)colored->pixels, colored->pitch,
+                    tex->w, tex->h, color_fgi, color_bgi);
       
-      SDL_UnlockSurface(color);
+      SDL_UnlockSurface(colored);
       SDL_UnlockSurface(tex);
       
-      SDL_Surface *disp = convert ?
-        SDL_Resize(color, dispx_z, dispy_z) :  // Convert to display format; deletes color
-        color;  // color is not deleted, but we don't want it to be.
-      // Insert and return
-      tile_cache[id] = disp;
-      return disp;
+      // Scale it to display size, unless it's there already, and copy it
+      // into a free cell
+      const int w = convert ? dispx_z : tex->w, h = convert ? dispy_z : tex->h;
+      page = tile_cache.insert(id, w, h, src);
+      SDL_Rect dst = src; // The blit clips dst
+      if (w == tex->w && h == tex->h) {
+        SDL_BlitSurface(colored, NULL, page, &dst);
+      } else {
+        SDL_Surface *disp = SDL_Resize(colored, w, h, false);
+        SDL_BlitSurface(disp, NULL, page, &dst);
+        SDL_FreeSurface(disp);
+      }
+      return page;
     }
   }
   
@@ -104,9 +346,10 @@ public:
     Either<texture_fullid,texture_ttfid> id = screen_to_texid(x, y);
     SDL_Surface *tex;
     if (id.isL) {      // Ordinary tile, cached here
-      tex = tile_cache_lookup(id.left);
+      SDL_Rect src;
+      tex = tile_cache_lookup(id.left, src);
       // And blit.
-      SDL_BlitSurface(tex, NULL, screen, &dst);
+      SDL_BlitSurface(tex, &src, screen, &dst);
     } else {  // TTF, cached in ttf_manager so no point in also caching here
       tex = ttf_manager.get_texture(id.right);
       // Blit later
@@ -115,12 +358,102 @@ public:
   }
 
   void update_all() {
+    if (screen->format->BytesPerPixel == 4 && render_workers.size() > 1) {
+      list<pair<SDL_Surface*,SDL_Rect> > ttfs;
+      if (resolve_sources(ttfs) && (!SDL_MUSTLOCK(screen) || SDL_LockSurface(screen) == 0)) {
+        // The framebuffer splits into bands of tile rows, which can be
+        // cleared and filled on as many threads as we've got.
+        black = SDL_MapRGB(screen->format, 0, 0, 0);
+        render_workers.run(copy_bands, this, gps.dimy);
+        if (SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
+        ttfs_to_render.splice(ttfs_to_render.end(), ttfs);
+        return;
+      }
+    }
     SDL_FillRect(screen, NULL, SDL_MapRGB(screen->format, 0, 0, 0));
     for (int x = 0; x < gps.dimx; x++)
       for (int y = 0; y < gps.dimy; y++)
         update_tile(x, y);
   }
 
+private:
+  // Where update_all's parallel path copies each tile from, row-major;
+  // page is NULL for tiles left black, TTF included
+  struct tile_source {
+    SDL_Surface *page;
+    SDL_Rect src;
+  };
+  vector<tile_source> sources;
+  Uint32 black;
+
+  // Looks every tile up, here on the main thread as the cache isn't
+  // thread-safe, and collects the TTFs for render(). Fails if some atlas
+  // page can't be copied from raw, or if the cache had to evict, as that
+  // may have reused a cell we'd already looked up.
+  bool resolve_sources(list<pair<SDL_Surface*,SDL_Rect> > &ttfs) {
+    const unsigned long evictions = tile_cache.evictions;
+    const SDL_PixelFormat *format = screen->format;
+    SDL_Surface *checked = NULL;
+    sources.resize(gps.dimx * gps.dimy);
+    for (int y = 0; y < gps.dimy; y++) {
+      for (int x = 0; x < gps.dimx; x++) {
+        tile_source &t = sources[y * gps.dimx + x];
+        Either<texture_fullid,texture_ttfid> id = screen_to_texid(x, y);
+        if (!id.isL) {
+          SDL_Rect dst;
+          dst.x = dispx_z * x + origin_x;
+          dst.y = dispy_z * y + origin_y;
+          ttfs.push_back(make_pair(ttf_manager.get_texture(id.right), dst));
+          t.page = NULL;
+          continue;
+        }
+        t.page = tile_cache_lookup(id.left, t.src);
+        if (t.page != checked) {
+          const SDL_PixelFormat *f = t.page->format;
+          if (SDL_MUSTLOCK(t.page) || f->BytesPerPixel != 4 || f->Rmask != format->Rmask ||
+              f->Gmask != format->Gmask || f->Bmask != format->Bmask)
+            return false;
+          checked = t.page;
+        }
+      }
+    }
+    return tile_cache.evictions == evictions;
+  }
+
+  // Clears and fills the pixel rows of tile rows [begin, end), clipped to
+  // the screen. The first and last bands take the margins too.
+  static void copy_bands(void *self, int begin, int end) {
+    renderer_2d_base *r = static_cast<renderer_2d_base*>(self);
+    SDL_Surface *screen = r->screen;
+    const int top = begin == 0 ? 0 :
+      CLAMP(r->origin_y + begin * r->dispy_z, 0, screen->h);
+    const int bottom = end == gps.dimy ? screen->h :
+      CLAMP(r->origin_y + end * r->dispy_z, 0, screen->h);
+    Uint8 *pixels = (Uint8*)screen->pixels;
+    for (int py = top; py < bottom; py++) {
+      Uint32 *row = (Uint32*)(pixels + py * screen->pitch);
+      for (int px = 0; px < screen->w; px++)
+        row[px] = r->black;
+    }
+    for (int y = begin; y < end; y++) {
+      const int dy = r->origin_y + y * r->dispy_z;
+      for (int x = 0; x < gps.dimx; x++) {
+        const tile_source &t = r->sources[y * gps.dimx + x];
+        if (!t.page) continue;
+        const int dx = r->origin_x + x * r->dispx_z;
+        const int x0 = MAX(dx, 0), x1 = MIN(dx + t.src.w, screen->w);
+        const int y0 = MAX(dy, top), y1 = MIN(dy + t.src.h, bottom);
+        if (x0 >= x1) continue;
+        const Uint8 *src = (const Uint8*)t.page->pixels + (t.src.x + x0 - dx) * 4;
+        for (int py = y0; py < y1; py++)
+          memcpy(pixels + py * screen->pitch + x0 * 4,
+                 src + (t.src.y + py - dy) * t.page->pitch, (x1 - x0) * 4);
+      }
+    }
+  }
+
+public:
+
   virtual void render() {
     // Render the TTFs, which we left for last
     for (auto it = ttfs_to_render.begin(); it != ttfs_to_render.end(); ++it) {
@@ -132,8 +465,7 @@ public:
   }
 
   virtual ~renderer_2d_base() {
-	for (auto it = tile_cache.cbegin(); it != tile_cache.cend(); ++it)
-		SDL_FreeSurface(it->second);
+	if (colored) SDL_FreeSurface(colored);
 	for (auto it = ttfs_to_render.cbegin(); it != ttfs_to_render.cend(); ++it)
 		SDL_FreeSurface(it->first);
   }
@@ -149,6 +481,7 @@ public:
   }
 
   renderer_2d_base() {
+    colored = NULL;
     zoom_steps = forced_steps = 0;
   }
   
@@ -229,10 +562,11 @@ public:
     dispx_z = MAX(1,try_x); dispy_z = MAX(try_y,1);
     cout << "Resizing font to " << dispx_z << "x" << dispy_z << endl;
     // Remove now-obsolete tile catalog
-    for (map<texture_fullid, SDL_Surface*>::iterator it = tile_cache.begin();
-         it != tile_cache.end();
-         ++it)
-      SDL_FreeSurface(it->second);
+#ifdef DEBUG
+    cout << "Tile cache: " << tile_cache.hits << " hits, " << tile_cache.misses
+         << " misses, " << tile_cache.evictions << " evictions, "
+         << (tile_cache.size() >> 10) << " KB in " << tile_cache.pages() << " pages" << endl;
+#endif
     tile_cache.clear();
     // Recompute grid based on the new tile size
     w = CLAMP(screen->w / dispx_z, MIN_GRID_X, MAX_GRID_X);
@@ -79,10 +79,11 @@ class renderer_curses : public renderer {
 public:
 
   void update_tile(int x, int y) {
-    const int ch   = gps.screen[x*gps.dimy*4 + y*4 + 0];
-    const int fg   = gps.screen[x*gps.dimy*4 + y*4 + 1];
-    const int bg   = gps.screen[x*gps.dimy*4 + y*4 + 2];
-    const int bold = gps.screen[x*gps.dimy*4 + y*4 + 3];
+    const unsigned char *s = tile_screen(x, y);
+    const int ch   = s[0];
+    const int fg   = s[1];
+    const int bg   = s[2];
+    const int bold = s[3];
 
     const int pair = lookup_pair(make_pair(fg,bg));
 
@@ -103,9 +104,10 @@ public:
   }
 
   void update_all() {
-    for (int x = 0; x < init.display.grid_x; x++)
-      for (int y = 0; y < init.display.grid_y; y++)
-        update_tile(x, y);
+    // Walk in memory order, which is also row order with GPS_ROW_MAJOR
+    const int tiles = gps.dimx * gps.dimy;
+    for (int tile = 0; tile < tiles; tile++)
+      update_tile(gps.tile_x(tile), gps.tile_y(tile));
   }
 
   void render() {
@@ -24,6 +24,10 @@ renderer_offscreen::~renderer_offscreen() {
   renderer::screentexpos_grayscale_old = NULL;
   renderer::screentexpos_cf_old = NULL;
   renderer::screentexpos_cbr_old = NULL;
+#ifdef GPS_PACKED_CELLS
+  delete[] cells;
+  cells = NULL;
+#endif
 
   SDL_FreeSurface(screen);
 }
@@ -53,19 +57,26 @@ renderer_offscreen::renderer_offscreen(int grid_x, int grid_y) {
   renderer::screentexpos_grayscale = gps.screentexpos_grayscale;
   renderer::screentexpos_cf = gps.screentexpos_cf;
   renderer::screentexpos_cbr = gps.screentexpos_cbr;
+#ifdef GPS_PACKED_CELLS
+  // We own these, unlike the planes
+  cells = new tile_cell[gps.dimx * gps.dimy];
+#endif
 }
 
 // Slurp the entire gps content into the renderer at some given offset
 void renderer_offscreen::update_all(int offset_x, int offset_y) {
+#ifdef GPS_PACKED_CELLS
+  pack_cells(cells, 0, gps.dimx * gps.dimy);
+#endif
   for (int x = 0; x < gps.dimx; x++) {
     for (int y = 0; y < gps.dimy; y++) {
       // Read tiles from gps, create cached texture
       Either<texture_fullid,texture_ttfid> id = screen_to_texid(x, y);
-      SDL_Surface *tex = id.isL ?
-        tile_cache_lookup(id.left, false) :
-        ttf_manager.get_texture(id.right);
+      SDL_Surface *tex;
+      SDL_Rect src, *srcp = NULL;
       if (id.isL) {
-        tex = tile_cache_lookup(id.left);
+        tex = tile_cache_lookup(id.left, src, false);
+        srcp = &src;
       } else {
         tex = enabler.textures.get_texture_data(id.right);
       }
@@ -74,7 +85,7 @@ void renderer_offscreen::update_all(int offset_x, int offset_y) {
       dst.x = dispx * (x+offset_x);
       dst.y = dispy * (y+offset_y);
       // And blit.
-      SDL_BlitSurface(tex, NULL, screen, &dst);
+      SDL_BlitSurface(tex, srcp, screen, &dst);
     }
   }
 }
@@ -1,3 +1,38 @@
+// Draws a tile's background and foreground in one go, so the GL renderers
+// need a single pass over their arrays. The fg color comes in as the
+// primary color and the bg as the secondary.
+static const char *single_pass_vertex_shader =
+  "#version 110\n"
+  "\n"
+  "void main() {\n"
+  "  gl_Position = ftransform();\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "  gl_FrontSecondaryColor = gl_SecondaryColor;\n"
+  "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+  "}\n";
+
+static const char *single_pass_fragment_shader =
+  "#version 110\n"
+  "\n"
+  "uniform sampler2D catalog;\n"
+  "\n"
+  "void main() {\n"
+  "  // As blending the foreground pass over the background pass would\n"
+  "  vec4 t = texture2D(catalog, gl_TexCoord[0].st);\n"
+  "  gl_FragColor = vec4(mix(gl_SecondaryColor.rgb, gl_Color.rgb * t.rgb, t.a), 1.0);\n"
+  "}\n";
+
+#ifdef DEBUG
+// Prints what KHR_debug reports, within printGLError's limit
+static void GLAPIENTRY report_gl_debug(GLenum source, GLenum type, GLuint id,
+                                       GLenum severity, GLsizei length,
+                                       const GLchar *message, const void *user) {
+  if (severity == GL_DEBUG_SEVERITY_NOTIFICATION || glerrorcount >= 40) return;
+  printf("GL debug: 0x%x %s\n", type, message);
+  glerrorcount++;
+}
+#endif
+
 // STANDARD
 class renderer_opengl : public renderer {
 public:
@@ -51,8 +86,13 @@ protected:
     return true;
   }
 
-  // Vertexes, foreground color, background color, texture coordinates
-  GLfloat *vertexes, *fg, *bg, *tex;
+  // Vertexes, foreground color, background color, texture coordinates.
+  // The colors are RGBA bytes.
+  GLfloat *vertexes, *tex;
+  GLubyte *fg, *bg;
+  // Draws each tile in one pass; 0 if the driver can't, in which case the
+  // background and foreground are drawn separately
+  GLuint single_pass_program;
 
   void write_tile_vertexes(GLfloat x, GLfloat y, GLfloat *vertex) {
     vertex[0]  = x;   // Upper left
@@ -72,63 +112,180 @@ protected:
   virtual void allocate(int tiles) {
     vertexes = static_cast<GLfloat*>(realloc(vertexes, sizeof(GLfloat) * tiles * 2 * 6));
     assert(vertexes);
-    fg = static_cast<GLfloat*>(realloc(fg, sizeof(GLfloat) * tiles * 4 * 6));
+    fg = static_cast<GLubyte*>(realloc(fg, sizeof(GLubyte) * tiles * 4 * 6));
     assert(fg);
-    bg = static_cast<GLfloat*>(realloc(bg, sizeof(GLfloat) * tiles * 4 * 6));
+    bg = static_cast<GLubyte*>(realloc(bg, sizeof(GLubyte) * tiles * 4 * 6));
     assert(bg);
     tex = static_cast<GLfloat*>(realloc(tex, sizeof(GLfloat) * tiles * 2 * 6));
     assert(tex);
 
-    glEnableClientState(GL_VERTEX_ARRAY);
+    gl_state.enable_client(GL_VERTEX_ARRAY);
     glVertexPointer(2, GL_FLOAT, 0, vertexes);
   }
   
+  void build_single_pass_program() {
+    single_pass_program = 0;
+    if (!GLEW_VERSION_2_0) return;
+    shader vs, fs;
+    vs.load_source("single_pass_vertex_shader", single_pass_vertex_shader);
+    fs.load_source("single_pass_fragment_shader", single_pass_fragment_shader);
+    const string cache_key = vs.source() + fs.source();
+    single_pass_program = shader::load_program("single_pass", cache_key);
+    if (!single_pass_program) {
+      GLuint vertex = vs.upload(GL_VERTEX_SHADER, false);
+      GLuint fragment = fs.upload(GL_FRAGMENT_SHADER, false);
+      if (vertex && fragment) {
+        single_pass_program = glCreateProgram();
+        glAttachShader(single_pass_program, vertex);
+        glAttachShader(single_pass_program, fragment);
+        if (!shader::link(single_pass_program, "single_pass", cache_key)) {
+          glDeleteProgram(single_pass_program);
+          single_pass_program = 0;
+        }
+      }
+      if (vertex) glDeleteShader(vertex);
+      if (fragment) glDeleteShader(fragment);
+    }
+    if (single_pass_program) {
+      gl_state.use_program(single_pass_program);
+      glUniform1i(glGetUniformLocation(single_pass_program, "catalog"), 0);
+      gl_state.use_program(0);
+    }
+    printGLError();
+  }
+
   virtual void init_opengl() {
+    // A new context, or one SDL may have reset
+    gl_state.invalidate();
+#ifdef DEBUG
+    // Have the driver report errors as they happen, instead of polling
+    // glGetError after every call
+    if (GLEW_KHR_debug) {
+      glEnable(GL_DEBUG_OUTPUT);
+      glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+      glDebugMessageCallback(report_gl_debug, NULL);
+      gl_debug_output = true;
+    }
+#endif
     enabler.textures.upload_textures();
+    build_single_pass_program();
   }
 
+  // True if update_tile writes a fixed slot per tile, and so is safe to call
+  // for different tiles concurrently. Renderers that append tiles can't.
+  virtual bool tiles_in_place() { return true; }
+
   virtual void uninit_opengl() {
+    if (single_pass_program) glDeleteProgram(single_pass_program);
+    single_pass_program = 0;
+    release_ttf_atlas();
+    enabler.release_fences();
+#ifdef DEBUG
+    cout << "GL state cache: " << gl_state.elided_calls() << " redundant calls skipped" << endl;
+#endif
     enabler.textures.remove_uploaded_textures();
   }
+
+  // The texture catalog, for subclasses; friendship isn't inherited
+  static GLuint catalog_texture() { return enabler.textures.gl_catalog; }
+  static const gl_texpos *catalog_coords() { return enabler.textures.gl_texpos; }
+  static int catalog_count() { return enabler.textures.catalog_count(); }
+  static unsigned int catalog_generation() { return enabler.textures.catalog_generation(); }
+  static bool catalog_layered() { return enabler.textures.catalog_layered(); }
+  static GLenum catalog_target() { return enabler.textures.catalog_target(); }
   
-  virtual void draw(int vertex_count) {
+  // Draws the vertex ranges given from the arrays given, which may be
+  // offsets into buffer objects if the caller binds them; fg_bo and so on
+  // say which. Leaves GL_ARRAY_BUFFER unbound.
+  void draw_arrays(GLuint vertexes_bo, const GLvoid *vertexes,
+                   GLuint fg_bo, const GLvoid *fg,
+                   GLuint bg_bo, const GLvoid *bg,
+                   GLuint tex_bo, const GLvoid *tex,
+                   const GLint *firsts, const GLsizei *counts, GLsizei ranges) {
+    if (vertexes_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertexes_bo);
+    glVertexPointer(2, GL_FLOAT, 0, vertexes);
+    if (single_pass_program) {
+      gl_state.disable(GL_BLEND);
+      gl_state.disable(GL_ALPHA_TEST);
+      gl_state.enable(GL_TEXTURE_2D);
+      gl_state.enable_client(GL_TEXTURE_COORD_ARRAY);
+      gl_state.enable_client(GL_SECONDARY_COLOR_ARRAY);
+      if (fg_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, fg_bo);
+      glColorPointer(4, GL_UNSIGNED_BYTE, 0, fg);
+      if (bg_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, bg_bo);
+      glSecondaryColorPointer(3, GL_UNSIGNED_BYTE, 4, bg);
+      if (tex_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, tex_bo);
+      glTexCoordPointer(2, GL_FLOAT, 0, tex);
+      gl_state.use_program(single_pass_program);
+      glMultiDrawArrays(GL_TRIANGLES, firsts, counts, ranges);
+      gl_state.use_program(0);
+      gl_state.disable_client(GL_SECONDARY_COLOR_ARRAY);
+      if (vertexes_bo || fg_bo || bg_bo || tex_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+      return;
+    }
     // Render the background colors
-    glDisable(GL_TEXTURE_2D);
-    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-    glDisable(GL_BLEND);
-    glDisable(GL_ALPHA_TEST);
-    glColorPointer(4, GL_FLOAT, 0, bg);
-    glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+    gl_state.disable(GL_TEXTURE_2D);
+    gl_state.disable_client(GL_TEXTURE_COORD_ARRAY);
+    gl_state.disable(GL_BLEND);
+    gl_state.disable(GL_ALPHA_TEST);
+    if (bg_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, bg_bo);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, bg);
+    glMultiDrawArrays(GL_TRIANGLES, firsts, counts, ranges);
     // Render the foreground, colors and textures both
-    glEnable(GL_ALPHA_TEST);
-    glAlphaFunc(GL_NOTEQUAL, 0);
-    glEnable(GL_TEXTURE_2D);
-    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    gl_state.enable(GL_ALPHA_TEST);
+    gl_state.alpha_func(GL_NOTEQUAL, 0);
+    gl_state.enable(GL_TEXTURE_2D);
+    gl_state.enable_client(GL_TEXTURE_COORD_ARRAY);
+    gl_state.enable(GL_BLEND);
+    gl_state.blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (tex_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, tex_bo);
     glTexCoordPointer(2, GL_FLOAT, 0, tex);
-    glColorPointer(4, GL_FLOAT, 0, fg);
-    glDrawArrays(GL_TRIANGLES, 0, vertex_count);
-    
+    if (fg_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, fg_bo);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, fg);
+    glMultiDrawArrays(GL_TRIANGLES, firsts, counts, ranges);
+    if (vertexes_bo || fg_bo || bg_bo || tex_bo) glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+  }
+
+  // Draws vertexes [0, vertex_count)
+  void draw_arrays(GLuint vertexes_bo, const GLvoid *vertexes,
+                   GLuint fg_bo, const GLvoid *fg,
+                   GLuint bg_bo, const GLvoid *bg,
+                   GLuint tex_bo, const GLvoid *tex, int vertex_count) {
+    const GLint first = 0;
+    const GLsizei count = vertex_count;
+    draw_arrays(vertexes_bo, vertexes, fg_bo, fg, bg_bo, bg, tex_bo, tex, &first, &count, 1);
+  }
+
+  virtual void draw(int vertex_count) {
+    draw_arrays(0, vertexes, 0, fg, 0, bg, 0, tex, vertex_count);
     printGLError();
   }
 
-  void write_tile_arrays(int x, int y, GLfloat *fg, GLfloat *bg, GLfloat *tex) {
+  static GLubyte color_byte(float c) { return GLubyte(c * 255 + 0.5f); }
+
+  void write_tile_arrays(int x, int y, GLubyte *fg, GLubyte *bg, GLfloat *tex) {
     Either<texture_fullid,texture_ttfid> id = screen_to_texid(x, y);
-    if (id.isL) {          // An ordinary tile
+    if (!id.isL) {
+      // TTF text is drawn on top by draw_ttf; leave a blank under it
+      texture_fullid blank;
+      blank.texpos = enabler.is_fullscreen() ?
+        init.font.large_font_texpos[' '] :
+        init.font.small_font_texpos[' '];
+      blank.fg = blank.bg = 0;
+      id = Either<texture_fullid,texture_ttfid>(blank);
+    }
+    {
+      // An ordinary tile
       const gl_texpos *txt = enabler.textures.gl_texpos;
+      const float *fgc = enabler.palette_color(id.left.fg);
+      const float *bgc = enabler.palette_color(id.left.bg);
+      const GLubyte fgb[4] = { color_byte(fgc[0]), color_byte(fgc[1]), color_byte(fgc[2]), 255 };
+      const GLubyte bgb[4] = { color_byte(bgc[0]), color_byte(bgc[1]), color_byte(bgc[2]), 255 };
       // TODO: Only bother to set the one that's actually read in flat-shading mode
       // And set flat-shading mode.
       for (int i = 0; i < 6; i++) {
-        *(fg++) = id.left.r;
-        *(fg++) = id.left.g;
-        *(fg++) = id.left.b;
-        *(fg++) = 1;
-        
-        *(bg++) = id.left.br;
-        *(bg++) = id.left.bg;
-        *(bg++) = id.left.bb;
-        *(bg++) = 1;
+        memcpy(fg, fgb, 4); fg += 4;
+        memcpy(bg, bgb, 4); bg += 4;
       }
       // Set texture coordinates
       *(tex++) = txt[id.left.texpos].left;   // Upper left
@@ -144,34 +301,173 @@ protected:
       *(tex++) = txt[id.left.texpos].bottom;
       *(tex++) = txt[id.left.texpos].right;  // Lower right
       *(tex++) = txt[id.left.texpos].top;
-    } else {
-      // TODO
     }
   }
+
+  // TTF text. Each tile a string covers shows one tile-wide column of it,
+  // taken from ttf_manager's atlas and drawn over the tiles.
+  struct ttf_tile {
+    int handle; // 0 if there's no text on the tile
+    int column;
+  };
+  vector<ttf_tile> ttf_tiles; // By x*gps.dimy + y
+  GLuint ttf_atlas;
+  int ttf_atlas_w, ttf_atlas_h; // Texture size, in pixels
+  int ttf_cells_x;              // Cells per row of it
+  vector<GLfloat> ttf_vertexes, ttf_texcoords;
+  vector<int> ttf_cells;
+  vector<unsigned char> ttf_pixels;
+
+  // Notes which column of which string, if any, tile x,y shows. Like
+  // update_tile, safe to call for different tiles at once.
+  void track_ttf(int x, int y) {
+    if (ttf_tiles.empty()) return;
+    ttf_tile &t = ttf_tiles[x*gps.dimy + y];
+    const unsigned char *s = tile_screen(x, y);
+    t.handle = 0;
+    if (s[3] == GRAPHICSTYPE_TTF) {
+      t.handle = *(const unsigned int*)s & 0xffffff;
+      t.column = 0;
+    } else if (s[3] == GRAPHICSTYPE_TTFCONT) {
+      // The string starts at the nearest TTF tile to the left, unless
+      // this is left over from text that's since been overwritten
+      const int handle = *(const unsigned int*)s & 0xffffff;
+      for (int ax = x - 1; ax >= 0; ax--) {
+        const unsigned char *a = tile_screen(ax, y);
+        if ((*(const unsigned int*)a & 0xffffff) != handle) break;
+        if (a[3] == GRAPHICSTYPE_TTF) {
+          t.handle = handle;
+          t.column = x - ax;
+          break;
+        }
+        if (a[3] != GRAPHICSTYPE_TTFCONT) break;
+      }
+    }
+  }
+
+  // For renderers whose update_all doesn't go through update_tile
+  void track_all_ttf() {
+    if (ttf_tiles.empty()) return;
+    for (int x = 0; x < gps.dimx; x++)
+      for (int y = 0; y < gps.dimy; y++)
+        track_ttf(x, y);
+  }
+
+  void release_ttf_atlas() {
+    if (ttf_atlas) glDeleteTextures(1, &ttf_atlas);
+    ttf_atlas = 0;
+  }
+
+  void draw_ttf() {
+    if (ttf_tiles.empty() || !ttf_manager.ttf_active()) return;
+    const int cell_w = ttf_manager.get_tile_width(), cell_h = ttf_manager.get_tile_height();
+    if (!ttf_atlas) {
+      // Room for a screenful of text at the usual grid sizes
+      GLint max_size;
+      glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+      const int cells_y = MIN(64, max_size / cell_h);
+      ttf_cells_x = MIN(64, max_size / cell_w);
+      for (ttf_atlas_w = 1; ttf_atlas_w < ttf_cells_x * cell_w; ttf_atlas_w *= 2);
+      for (ttf_atlas_h = 1; ttf_atlas_h < cells_y * cell_h; ttf_atlas_h *= 2);
+      glGenTextures(1, &ttf_atlas);
+      glBindTexture(GL_TEXTURE_2D, ttf_atlas);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ttf_atlas_w, ttf_atlas_h, 0,
+                   GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+      // Cells sit side by side, so filtering would bleed between them.
+      // The text is rendered at the on-screen tile size anyway.
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      ttf_manager.atlas_reset(ttf_cells_x, cells_y);
+    }
+    const int cells_x = ttf_cells_x;
+    // Build the quads, placing any text the atlas doesn't have yet
+    ttf_vertexes.clear();
+    ttf_texcoords.clear();
+    for (int x = 0; x < gps.dimx; x++) {
+      for (int y = 0; y < gps.dimy; y++) {
+        const ttf_tile &t = ttf_tiles[x*gps.dimy + y];
+        if (!t.handle) continue;
+        // Stale if the start of the string has changed since
+        const ttf_tile &anchor = ttf_tiles[(x - t.column)*gps.dimy + y];
+        if (anchor.handle != t.handle || anchor.column != 0) continue;
+        const int cell = ttf_manager.atlas_cell(t.handle, t.column);
+        if (cell < 0) continue;
+        GLfloat v[12];
+        write_tile_vertexes(x, y, v);
+        ttf_vertexes.insert(ttf_vertexes.end(), v, v + 12);
+        const GLfloat left   = GLfloat(cell % cells_x * cell_w) / ttf_atlas_w;
+        const GLfloat right  = GLfloat((cell % cells_x + 1) * cell_w) / ttf_atlas_w;
+        const GLfloat top    = GLfloat(cell / cells_x * cell_h) / ttf_atlas_h;
+        const GLfloat bottom = GLfloat((cell / cells_x + 1) * cell_h) / ttf_atlas_h;
+        const GLfloat tc[12] = { left, top, right, top, left, bottom,
+                                 left, bottom, right, top, right, bottom };
+        ttf_texcoords.insert(ttf_texcoords.end(), tc, tc + 12);
+      }
+    }
+    // Upload what was placed
+    ttf_manager.atlas_take_uploads(ttf_cells, ttf_pixels);
+    glBindTexture(GL_TEXTURE_2D, ttf_atlas);
+    for (size_t i = 0; i < ttf_cells.size(); i++) {
+      const int cell = ttf_cells[i];
+      glTexSubImage2D(GL_TEXTURE_2D, 0, cell % cells_x * cell_w, cell / cells_x * cell_h,
+                      cell_w, cell_h, GL_RGBA, GL_UNSIGNED_BYTE,
+                      &ttf_pixels[i * cell_w * cell_h * 4]);
+    }
+    if (ttf_vertexes.size()) {
+      // The text comes with its background, so it just gets copied over
+      gl_state.use_program(0);
+      gl_state.disable(GL_BLEND);
+      gl_state.disable(GL_ALPHA_TEST);
+      gl_state.enable(GL_TEXTURE_2D);
+      glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+      gl_state.enable_client(GL_VERTEX_ARRAY);
+      gl_state.disable_client(GL_COLOR_ARRAY);
+      gl_state.enable_client(GL_TEXTURE_COORD_ARRAY);
+      glColor4f(1, 1, 1, 1);
+      glVertexPointer(2, GL_FLOAT, 0, &ttf_vertexes[0]);
+      glTexCoordPointer(2, GL_FLOAT, 0, &ttf_texcoords[0]);
+      glDrawArrays(GL_TRIANGLES, 0, ttf_vertexes.size() / 2);
+      gl_state.enable_client(GL_COLOR_ARRAY);
+    }
+    glBindTexture(catalog_target(), catalog_texture());
+    printGLError();
+  }
   
 public:
   void update_tile(int x, int y) {
     const int tile = x*gps.dimy + y;
     // Update the arrays
-    GLfloat *fg  = this->fg + tile * 4 * 6;
-    GLfloat *bg  = this->bg + tile * 4 * 6;
+    GLubyte *fg  = this->fg + tile * 4 * 6;
+    GLubyte *bg  = this->bg + tile * 4 * 6;
     GLfloat *tex = this->tex + tile * 2 * 6;
     write_tile_arrays(x, y, fg, bg, tex);
+    track_ttf(x, y);
   }
 
   void update_all() {
     glClear(GL_COLOR_BUFFER_BIT);
-    for (int x = 0; x < gps.dimx; x++)
+    if (tiles_in_place()) {
+      // Every tile has its own slice of the arrays, so columns can be
+      // filled on as many threads as we've got.
+      render_workers.run(update_columns, this, gps.dimx);
+    } else {
+      for (int x = 0; x < gps.dimx; x++)
+        for (int y = 0; y < gps.dimy; y++)
+          update_tile(x, y);
+    }
+  }
+
+  static void update_columns(void *self, int begin, int end) {
+    renderer_opengl *r = static_cast<renderer_opengl*>(self);
+    for (int x = begin; x < end; x++)
       for (int y = 0; y < gps.dimy; y++)
-        update_tile(x, y);
+        r->update_tile(x, y);
   }
   
   void render() {
     draw(gps.dimx*gps.dimy*6);
-    if (init.display.flag.has_flag(INIT_DISPLAY_FLAG_ARB_SYNC) && GL_ARB_sync) {
-      assert(enabler.sync == NULL);
-      enabler.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-    }
+    draw_ttf();
+    enabler.fence_frame();
     SDL_GL_SwapBuffers();
   }
 
@@ -182,6 +478,9 @@ public:
     fg       = NULL;
     bg       = NULL;
     tex      = NULL;
+    single_pass_program = 0;
+    ttf_atlas = 0;
+    ttf_atlas_w = ttf_atlas_h = ttf_cells_x = 0;
     zoom_steps = forced_steps = 0;
     
     // Disable key repeat
@@ -320,13 +619,14 @@ public:
   virtual void reshape_gl() {
     // Allocate array memory
     allocate(gps.dimx * gps.dimy);
-    // Initialize the vertex array
+    // Initialize the vertex array, if this renderer keeps one
     int tile = 0;
-    for (GLfloat x = 0; x < gps.dimx; x++)
-      for (GLfloat y = 0; y < gps.dimy; y++, tile++)
-        write_tile_vertexes(x, y, vertexes + 6*2*tile);
+    if (vertexes)
+      for (GLfloat x = 0; x < gps.dimx; x++)
+        for (GLfloat y = 0; y < gps.dimy; y++, tile++)
+          write_tile_vertexes(x, y, vertexes + 6*2*tile);
     // Setup invariant state
-    glEnableClientState(GL_COLOR_ARRAY);
+    gl_state.enable_client(GL_COLOR_ARRAY);
     /// Set up our coordinate system
     if (forced_steps + zoom_steps == 0 &&
         init.display.flag.has_flag(INIT_DISPLAY_FLAG_BLACK_SPACE)) {
@@ -347,6 +647,10 @@ public:
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     gluOrtho2D(0, gps.dimx, gps.dimy, 0);
+    // Reset TTF rendering, at the size tiles come out on screen
+    ttf_tiles.assign(gps.dimx * gps.dimy, ttf_tile());
+    release_ttf_atlas();
+    ttf_manager.init(MAX(size_y / gps.dimy, 1), MAX(size_x / gps.dimx, 1));
   }
 
   // Parameters: window size
@@ -403,6 +707,7 @@ protected:
                       fg + tile_count * 6 * 4,
                       bg + tile_count * 6 * 4,
                       tex + tile_count * 6 * 2);
+    track_ttf(x, y);
     tile_count++;
   }
 
@@ -411,132 +716,14 @@ protected:
     tile_count = 0;
   }
 
+  bool tiles_in_place() { return false; }
+
 public:
   renderer_once() {
     tile_count = 0;
   }
 };
 
-// PARTIAL:N
-class renderer_partial : public renderer_opengl {
-  int buffersz;
-  list<int> erasz; // Previous eras
-  int current_erasz; // And the current one
-  int sum_erasz;
-  int head, tail; // First unused tile, first used tile respectively
-  int redraw_count; // Number of eras to max out at
-
-  void update_tile(int x, int y) {
-    write_tile_vertexes(x, y, vertexes + head * 6 * 2);
-    write_tile_arrays(x, y,
-                      fg + head * 6 * 4,
-                      bg + head * 6 * 4,
-                      tex + head * 6 * 2);
-    head = (head + 1) % buffersz;
-    current_erasz++; sum_erasz++;
-    if (head == tail) {
-      //gamelog << "Expanding partial-printing buffer" << endl;
-      // Buffer is full, expand it.
-      renderer_opengl::allocate(buffersz * 2);
-      // Move the tail to the end of the newly allocated space
-      tail += buffersz;
-      memmove(vertexes + tail * 6 * 2, vertexes + head * 6 * 2, sizeof(GLfloat) * 6 * 2 * (buffersz - head));
-      memmove(fg + tail * 6 * 4, fg + head * 6 * 4, sizeof(GLfloat) * 6 * 4 * (buffersz - head));
-      memmove(bg + tail * 6 * 4, fg + head * 6 * 4, sizeof(GLfloat) * 6 * 4 * (buffersz - head));
-      memmove(tex + tail * 6 * 2, fg + head * 6 * 2, sizeof(GLfloat) * 6 * 2 * (buffersz - head));
-      // And finish.
-      buffersz *= 2;
-    }
-  }
-
-  void allocate(int tile_count) {
-    assert(false);
-  }
-  
-  virtual void reshape_gl() {
-    // TODO: This function is duplicate code w/base class reshape_gl
-    // Setup invariant state
-    glEnableClientState(GL_COLOR_ARRAY);
-    /// Set up our coordinate system
-    if (forced_steps + zoom_steps == 0 &&
-        init.display.flag.has_flag(INIT_DISPLAY_FLAG_BLACK_SPACE)) {
-      size_x = gps.dimx * dispx;
-      size_y = gps.dimy * dispy;
-      off_x = (screen->w - size_x) / 2;
-      off_y = (screen->h - size_y) / 2;
-    } else {
-      // If we're zooming (or just not using black space), we use the
-      // entire window.
-      size_x = screen->w;
-      size_y = screen->h;
-      off_x = off_y = 0;
-    }
-    glViewport(off_x, off_y, size_x, size_y);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluOrtho2D(0, gps.dimx, gps.dimy, 0);
-  }
-
-  void draw_arrays(GLfloat *vertexes, GLfloat *fg, GLfloat *bg, GLfloat *tex, int tile_count) {
-    // Set vertex pointer
-    glVertexPointer(2, GL_FLOAT, 0, vertexes);
-    // Render the background colors
-    glDisable(GL_TEXTURE_2D);
-    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-    glDisable(GL_BLEND);
-    glDisable(GL_ALPHA_TEST);
-    glColorPointer(4, GL_FLOAT, 0, bg);
-    glDrawArrays(GL_TRIANGLES, 0, tile_count * 6);
-    // Render the foreground, colors and textures both
-    glEnable(GL_ALPHA_TEST);
-    glAlphaFunc(GL_NOTEQUAL, 0);
-    glEnable(GL_TEXTURE_2D);
-    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glColorPointer(4, GL_FLOAT, 0, fg);
-    glTexCoordPointer(2, GL_FLOAT, 0, tex);
-    glDrawArrays(GL_TRIANGLES, 0, tile_count * 6);
-  }
-
-  void draw(int dummy) {
-    if (tail > head) {
-      // We're straddling the end of the array, so have to do this in two steps
-      draw_arrays(vertexes + tail * 6 * 2,
-                  fg + tail * 6 * 4,
-                  bg + tail * 6 * 4,
-                  tex + tail * 6 * 2,
-                  buffersz - tail);
-      draw_arrays(vertexes, fg, bg, tex, head-1);
-    } else {
-      draw_arrays(vertexes + tail * 6 * 2,
-                  fg + tail * 6 * 4,
-                  bg + tail * 6 * 4,
-                  tex + tail * 6 * 2,
-                  sum_erasz);
-    }
-    
-    printGLError();
-    erasz.push_back(current_erasz); current_erasz = 0;
-    if (erasz.size() == redraw_count) {
-      // Right, time to retire the oldest era.
-      tail = (tail + erasz.front()) % buffersz;
-      sum_erasz -= erasz.front();
-      erasz.pop_front();
-    }
-  }
-  
-public:
-  renderer_partial() {
-    redraw_count = init.display.partial_print_count;
-    buffersz = 2048;
-    renderer_opengl::allocate(buffersz);
-    current_erasz = head = tail = sum_erasz = 0;
-  }
-};
-
 class renderer_accum_buffer : public renderer_once {
   void draw(int vertex_count) {
     // Copy the previous frame's buffer back in
@@ -591,19 +778,192 @@ class renderer_framebuffer : public renderer_once {
 };
 
 class renderer_vbo : public renderer_opengl {
-  GLuint vbo; // Vertexes only
+protected:
+  // Vertexes, foreground color, background color, texture coordinates
+  enum { vbo_vertexes, vbo_fg, vbo_bg, vbo_tex, vbo_count };
+  GLuint vbo[vbo_count];
+  int tiles; // Size of the buffers
+
+private:
+  // Tiles rewritten since the buffers were last updated, one bit each. If
+  // upload_all is set they're all stale, and touched isn't kept.
+  vector<uint32_t> touched;
+  bool upload_all;
+  // Unchanged tiles between two runs that are cheaper to resend than to
+  // split the upload over
+  static const int max_gap = 8;
+
+  // (Re)creates the buffers at the current grid size
+  void create_buffers() {
+    if (!vbo[0]) glGenBuffersARB(vbo_count, vbo);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_vertexes]);
+    glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLfloat) * tiles * 6 * 2, vertexes, GL_STATIC_DRAW_ARB);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_fg]);
+    glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLubyte) * tiles * 6 * 4, NULL, GL_STREAM_DRAW_ARB);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_bg]);
+    glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLubyte) * tiles * 6 * 4, NULL, GL_STREAM_DRAW_ARB);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_tex]);
+    glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLfloat) * tiles * 6 * 2, NULL, GL_STREAM_DRAW_ARB);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+    upload_all = true;
+    printGLError();
+  }
+
+  // Copies tiles [begin, end) of the arrays into the buffers
+  void upload(int begin, int end) {
+    const int count = end - begin;
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_fg]);
+    glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLubyte) * begin * 6 * 4,
+                       sizeof(GLubyte) * count * 6 * 4, fg + begin * 6 * 4);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_bg]);
+    glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLubyte) * begin * 6 * 4,
+                       sizeof(GLubyte) * count * 6 * 4, bg + begin * 6 * 4);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_tex]);
+    glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLfloat) * begin * 6 * 2,
+                       sizeof(GLfloat) * count * 6 * 2, tex + begin * 6 * 2);
+  }
+
+protected:
+  void upload_changes() {
+    if (upload_all) {
+      // Respecify the whole store, so the driver needn't wait on the last frame
+      glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_fg]);
+      glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLubyte) * tiles * 6 * 4, fg, GL_STREAM_DRAW_ARB);
+      glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_bg]);
+      glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLubyte) * tiles * 6 * 4, bg, GL_STREAM_DRAW_ARB);
+      glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo[vbo_tex]);
+      glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(GLfloat) * tiles * 6 * 2, tex, GL_STREAM_DRAW_ARB);
+      std::fill(touched.begin(), touched.end(), 0);
+      upload_all = false;
+      return;
+    }
+    // Walk the touched tiles in order, merging runs that are close together
+    int begin = -1, end = 0;
+    for (int w = 0; w < touched.size(); w++) {
+      for (uint32_t word = touched[w]; word; word &= word - 1) {
+        const int tile = (w << 5) + lowest_bit(word);
+        if (begin < 0 || tile > end + max_gap) {
+          if (begin >= 0) upload(begin, end);
+          begin = tile;
+        }
+        end = tile + 1;
+      }
+      touched[w] = 0;
+    }
+    if (begin >= 0) upload(begin, end);
+  }
 
+  // Not reached from renderer_opengl's constructor; the buffers are
+  // created by the first reshape_gl instead.
   void init_opengl() {
     renderer_opengl::init_opengl();
-    glGenBuffersARB(1, &vbo);
-    glBindBufferARB(GL_ARRAY_BUFFER_ARB, vbo);
-    glBufferDataARB(GL_ARRAY_BUFFER_ARB, gps.dimx*gps.dimy*6*2*sizeof(GLfloat), vertexes, GL_STATIC_DRAW_ARB);
-    glVertexPointer(2, GL_FLOAT, 0, 0);
-    glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+    // Coming back from a resize that kept the grid
+    if (tiles) create_buffers();
   }
   
   void uninit_opengl() {
-    glDeleteBuffersARB(1, &vbo);
+    if (vbo[0]) glDeleteBuffersARB(vbo_count, vbo);
+    memset(vbo, 0, sizeof(vbo));
     renderer_opengl::uninit_opengl();
   }
+
+  void allocate(int tiles) {
+    renderer_opengl::allocate(tiles);
+    this->tiles = tiles;
+    touched.assign((tiles + 31) / 32, 0);
+  }
+
+  void reshape_gl() {
+    renderer_opengl::reshape_gl();
+    create_buffers();
+  }
+
+  void draw(int vertex_count) {
+    upload_changes();
+    draw_arrays(vbo[vbo_vertexes], 0, vbo[vbo_fg], 0,
+                vbo[vbo_bg], 0, vbo[vbo_tex], 0, vertex_count);
+    printGLError();
+  }
+
+public:
+  void update_tile(int x, int y) {
+    renderer_opengl::update_tile(x, y);
+    if (!upload_all) {
+      const int tile = x*gps.dimy + y;
+      touched[tile >> 5] |= 1u << (tile & 31);
+    }
+  }
+
+  void update_all() {
+    // Set first: the columns get filled on several threads, and
+    // must not touch the bitmap
+    upload_all = true;
+    renderer_opengl::update_all();
+  }
+
+  renderer_vbo() {
+    memset(vbo, 0, sizeof(vbo));
+    tiles = 0;
+    upload_all = true;
+  }
+};
+
+// PARTIAL:N
+//
+// For when the buffers being swapped aren't copied, so the frame we draw
+// over is the one from N frames ago. Instead of clearing, redraws each tile
+// that changed in any of the last N frames. The arrays and buffers are
+// renderer_vbo's, laid out by grid position, so a tile that keeps changing
+// is uploaded once per change and never duplicated.
+class renderer_partial : public renderer_vbo {
+  unsigned int redraw_count; // Frames a change stays on the redraw list
+  unsigned int generation;   // Frames drawn so far
+  // Generation each tile last changed in
+  vector<unsigned int> stamp;
+  // Runs of vertexes to draw this frame
+  vector<GLint> firsts;
+  vector<GLsizei> counts;
+
+  void allocate(int tiles) {
+    renderer_vbo::allocate(tiles);
+    // Old enough to stay off the redraw list until it changes
+    stamp.assign(tiles, generation - redraw_count);
+  }
+
+  void draw(int dummy) {
+    upload_changes();
+    // Collect runs of recently changed tiles. Unsigned, so this works
+    // across wraparound.
+    firsts.clear();
+    counts.clear();
+    for (int tile = 0; tile < tiles;) {
+      if (generation - stamp[tile] >= redraw_count) {
+        tile++;
+        continue;
+      }
+      int end = tile + 1;
+      while (end < tiles && generation - stamp[end] < redraw_count)
+        end++;
+      firsts.push_back(tile * 6);
+      counts.push_back((end - tile) * 6);
+      tile = end;
+    }
+    if (firsts.size())
+      draw_arrays(vbo[vbo_vertexes], 0, vbo[vbo_fg], 0,
+                  vbo[vbo_bg], 0, vbo[vbo_tex], 0,
+                  &firsts[0], &counts[0], firsts.size());
+    printGLError();
+    generation++;
+  }
+
+public:
+  void update_tile(int x, int y) {
+    renderer_vbo::update_tile(x, y);
+    stamp[x*gps.dimy + y] = generation;
+  }
+
+  renderer_partial() {
+    redraw_count = MAX(init.display.partial_print_count, 1);
+    generation = 0;
+  }
 };
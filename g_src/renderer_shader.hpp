@@ -0,0 +1,694 @@
+// PRINT_MODE:SHADER
+//
+// Leaves tile expansion to the GPU. The gps planes of the frame on display
+// go up as texture buffers, and the vertex shader works out each tile's
+// texture coordinates and colors from them, so a frame costs one copy of
+// the tiles that changed. Needs OpenGL 3.1; without it, or if the shaders
+// won't build, this behaves exactly like PRINT_MODE:STANDARD.
+
+static const char *tile_vertex_shader =
+  "#version 140\n"
+  "\n"
+  "// Expands one tile of gps into a quad. Vertices find their tile by index;\n"
+  "// the position attribute only puts the quad on the grid.\n"
+  "in vec2 position;\n"
+  "\n"
+  "uniform ivec2 grid; // gps.dimx, gps.dimy\n"
+  "uniform bool use_graphics;\n"
+  "\n"
+  "#ifdef GPS_PACKED_CELLS\n"
+  "uniform usamplerBuffer cells;\n"
+  "#else\n"
+  "uniform usamplerBuffer screen;\n"
+  "uniform isamplerBuffer texpos;\n"
+  "uniform usamplerBuffer addcolor;\n"
+  "uniform usamplerBuffer grayscale;\n"
+  "uniform usamplerBuffer cf;\n"
+  "uniform usamplerBuffer cbr;\n"
+  "#endif\n"
+  "uniform isamplerBuffer font;   // Character to texpos, for the current font\n"
+  "uniform bool layers;           // The catalog has a layer per texpos\n"
+  "uniform samplerBuffer coords;  // If not, texpos to left, right, top, bottom\n"
+  "uniform samplerBuffer palette; // See enablerst::palette_color\n"
+  "\n"
+  "flat out vec3 fg_color;\n"
+  "flat out vec3 bg_color;\n"
+  "out vec3 texcoord;\n"
+  "\n"
+  "void main() {\n"
+  "  int tile = gl_VertexID / 6, corner = gl_VertexID % 6;\n"
+  "  // The quads go column by column, as renderer_opengl lays them out\n"
+  "  int x = tile / grid.y, y = tile % grid.y;\n"
+  "#ifdef GPS_ROW_MAJOR\n"
+  "  int index = y * grid.x + x;\n"
+  "#else\n"
+  "  int index = tile;\n"
+  "#endif\n"
+  "\n"
+  "#ifdef GPS_PACKED_CELLS\n"
+  "  uvec4 cell = texelFetch(cells, index);\n"
+  "  uvec4 s = (uvec4(cell.x) >> uvec4(0u, 8u, 16u, 24u)) & 0xffu;\n"
+  "  int tex = int(cell.y);\n"
+  "  // addcolor, grayscale, cf, cbr\n"
+  "  uvec4 graphics = (uvec4(cell.z) >> uvec4(0u, 8u, 16u, 24u)) & 0xffu;\n"
+  "#else\n"
+  "  uvec4 s = texelFetch(screen, index);\n"
+  "  int tex = 0;\n"
+  "  uvec4 graphics = uvec4(0u);\n"
+  "  if (use_graphics) {\n"
+  "    tex = texelFetch(texpos, index).x;\n"
+  "    graphics = uvec4(texelFetch(addcolor, index).x, texelFetch(grayscale, index).x,\n"
+  "                     texelFetch(cf, index).x, texelFetch(cbr, index).x);\n"
+  "  }\n"
+  "#endif\n"
+  "\n"
+  "  // As renderer::screen_to_texid\n"
+  "  int ch = int(s.x);\n"
+  "  int bold = s.w != 0u ? 8 : 0;\n"
+  "  int fg = (int(s.y) + bold) % 16, bg = int(s.z) % 16;\n"
+  "  bool ttf = s.w == 255u;\n"
+  "  if (s.w >= 254u) {\n"
+  "    // TTF text is drawn on top by renderer_opengl::draw_ttf; leave a blank\n"
+  "    ch = 32;\n"
+  "    fg = bg = 0;\n"
+  "  }\n"
+  "  int t = texelFetch(font, ch).x;\n"
+  "  if (use_graphics && !ttf && tex != 0) {\n"
+  "    t = tex;\n"
+  "    if (graphics.y != 0u) {\n"
+  "      fg = int(graphics.z);\n"
+  "      bg = int(graphics.w);\n"
+  "    } else if (graphics.x == 0u) {\n"
+  "      fg = 16; // PALETTE_WHITE\n"
+  "      bg = 17; // PALETTE_BLACK\n"
+  "    }\n"
+  "  }\n"
+  "  fg_color = texelFetch(palette, min(fg, 17)).rgb;\n"
+  "  bg_color = texelFetch(palette, min(bg, 17)).rgb;\n"
+  "\n"
+  "  bool right = corner == 1 || corner == 4 || corner == 5;\n"
+  "  bool lower = corner == 2 || corner == 3 || corner == 5;\n"
+  "  if (layers) {\n"
+  "    texcoord = vec3(right ? 1.0 : 0.0, lower ? 1.0 : 0.0, float(t));\n"
+  "  } else {\n"
+  "    vec4 c = texelFetch(coords, t);\n"
+  "    texcoord = vec3(right ? c.y : c.x, lower ? c.z : c.w, 0.0);\n"
+  "  }\n"
+  "  gl_Position = vec4(position.x * 2.0 / float(grid.x) - 1.0,\n"
+  "                     1.0 - position.y * 2.0 / float(grid.y), 0.0, 1.0);\n"
+  "}\n";
+
+static const char *tile_fragment_shader =
+  "#version 140\n"
+  "\n"
+  "// Shader renderers always get the catalog as an array; see\n"
+  "// textures::use_layers\n"
+  "uniform sampler2DArray catalog;\n"
+  "\n"
+  "flat in vec3 fg_color;\n"
+  "flat in vec3 bg_color;\n"
+  "in vec3 texcoord;\n"
+  "out vec4 color;\n"
+  "\n"
+  "void main() {\n"
+  "  // The background, with the color-modulated texture blended over it\n"
+  "  vec4 t = texture(catalog, texcoord);\n"
+  "  color = vec4(mix(bg_color, fg_color * t.rgb, t.a), 1.0);\n"
+  "}\n";
+
+// The catalog coordinates and palette, as buffer textures the shaders can
+// index by texpos and palette index
+class tile_tables {
+  // What the tables were last built from
+  unsigned int coords_generation;
+  int coords_count;
+  float palette[18][4];
+ public:
+  texture_bo coords_bo, palette_bo;
+
+  // Keeps the tables in step with the catalog and palette
+  void update(const gl_texpos *coords, int count, unsigned int generation) {
+    if (coords_generation != generation || coords_count != count) {
+      coords_generation = generation;
+      coords_count = count;
+      coords_bo.buffer((GLvoid*)coords, MAX(coords_count, 1) * sizeof(gl_texpos));
+    }
+    float colors[18][4];
+    for (int i = 0; i < 18; i++) {
+      const float *c = enabler.palette_color(i);
+      colors[i][0] = c[0]; colors[i][1] = c[1]; colors[i][2] = c[2]; colors[i][3] = 1;
+    }
+    if (memcmp(colors, palette, sizeof(palette))) {
+      memcpy(palette, colors, sizeof(palette));
+      palette_bo.buffer(palette, sizeof(palette));
+    }
+  }
+
+  void reset() {
+    coords_bo.reset();
+    palette_bo.reset();
+    coords_generation = 0;
+    coords_count = -1;
+    memset(palette, 0, sizeof(palette));
+  }
+
+  tile_tables() {
+    coords_generation = 0;
+    coords_count = -1;
+    memset(palette, 0, sizeof(palette));
+  }
+};
+
+class renderer_shader : public renderer_opengl {
+  bool fallback; // Drawing as renderer_opengl
+  GLuint program;
+  GLint grid_uniform, layers_uniform;
+#ifdef GPS_PACKED_CELLS
+  texture_bo cells_bo;
+#else
+  texture_bo screen_bo, texpos_bo, addcolor_bo, grayscale_bo, cf_bo, cbr_bo;
+#endif
+  texture_bo font_bo;
+  tile_tables tables;
+  // Tiles, in gps memory order, that changed since the last upload
+  int dirty_begin, dirty_end;
+
+  // Integer formats the long-typed gps arrays can be read as. Only the low
+  // word matters; we're little-endian.
+  static GLenum long_format() { return sizeof(long) == 8 ? GL_RG32I : GL_R32I; }
+
+  // Compiles and links the program from source
+  bool compile_program(shader &vs, shader &fs, const string &cache_key) {
+    GLuint vertex = vs.upload(GL_VERTEX_SHADER, false);
+    GLuint fragment = fs.upload(GL_FRAGMENT_SHADER, false);
+    if (!vertex || !fragment) {
+      if (vertex) glDeleteShader(vertex);
+      if (fragment) glDeleteShader(fragment);
+      return false;
+    }
+    program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    // Generic attribute 0 stands in for glVertex, so drawing works in a
+    // compatibility context
+    glBindAttribLocation(program, 0, "position");
+    glBindFragDataLocation(program, 0, "color");
+    // The program keeps them alive as long as it needs them
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    if (!shader::link(program, "renderer_shader", cache_key)) {
+      glDeleteProgram(program);
+      program = 0;
+      return false;
+    }
+    return true;
+  }
+
+  bool build_program() {
+    shader vs, fs;
+    vs.load_source("tile_vertex_shader", tile_vertex_shader);
+    fs.load_source("tile_fragment_shader", tile_fragment_shader);
+#ifdef GPS_PACKED_CELLS
+    vs.header << "#define GPS_PACKED_CELLS" << std::endl;
+#endif
+#ifdef GPS_ROW_MAJOR
+    vs.header << "#define GPS_ROW_MAJOR" << std::endl;
+#endif
+    const string cache_key = vs.source() + fs.source();
+    program = shader::load_program("renderer_shader", cache_key);
+    if (!program && !compile_program(vs, fs, cache_key)) return false;
+
+    // Texture units never change, so the samplers are set once
+    static const char *samplers[] = {
+      "catalog",
+#ifdef GPS_PACKED_CELLS
+      "cells",
+#else
+      "screen", "texpos", "addcolor", "grayscale", "cf", "cbr",
+#endif
+      "font", "coords", "palette" };
+    gl_state.use_program(program);
+    for (int i = 0; i < sizeof(samplers) / sizeof(samplers[0]); i++)
+      glUniform1i(glGetUniformLocation(program, samplers[i]), i);
+    glUniform1i(glGetUniformLocation(program, "use_graphics"),
+                init.display.flag.has_flag(INIT_DISPLAY_FLAG_USE_GRAPHICS));
+    grid_uniform = glGetUniformLocation(program, "grid");
+    layers_uniform = glGetUniformLocation(program, "layers");
+    gl_state.use_program(0);
+    printGLError();
+    return true;
+  }
+
+  // Copies the changed range of the frame on display into the buffers
+  void upload_planes() {
+    if (dirty_begin >= dirty_end) return;
+    const int begin = dirty_begin, count = dirty_end - dirty_begin;
+#ifdef GPS_PACKED_CELLS
+    cells_bo.update(begin * sizeof(tile_cell), count * sizeof(tile_cell), cells + begin);
+#else
+    screen_bo.update(begin * 4, count * 4, screen + begin * 4);
+    if (init.display.flag.has_flag(INIT_DISPLAY_FLAG_USE_GRAPHICS)) {
+      texpos_bo.update(begin * sizeof(long), count * sizeof(long), screentexpos + begin);
+      addcolor_bo.update(begin, count, screentexpos_addcolor + begin);
+      grayscale_bo.update(begin, count, screentexpos_grayscale + begin);
+      cf_bo.update(begin, count, screentexpos_cf + begin);
+      cbr_bo.update(begin, count, screentexpos_cbr + begin);
+    }
+#endif
+    dirty_begin = dirty_end = 0;
+  }
+
+  void allocate_planes(int tiles) {
+#ifdef GPS_PACKED_CELLS
+    cells_bo.buffer(NULL, tiles * sizeof(tile_cell), GL_STREAM_DRAW_ARB);
+#else
+    screen_bo.buffer(NULL, tiles * 4, GL_STREAM_DRAW_ARB);
+    texpos_bo.buffer(NULL, tiles * sizeof(long), GL_STREAM_DRAW_ARB);
+    addcolor_bo.buffer(NULL, tiles, GL_STREAM_DRAW_ARB);
+    grayscale_bo.buffer(NULL, tiles, GL_STREAM_DRAW_ARB);
+    cf_bo.buffer(NULL, tiles, GL_STREAM_DRAW_ARB);
+    cbr_bo.buffer(NULL, tiles, GL_STREAM_DRAW_ARB);
+#endif
+    dirty_begin = 0;
+    dirty_end = tiles;
+  }
+
+  void release_gl() {
+    if (program) glDeleteProgram(program);
+    program = 0;
+#ifdef GPS_PACKED_CELLS
+    cells_bo.reset();
+#else
+    screen_bo.reset(); texpos_bo.reset(); addcolor_bo.reset();
+    grayscale_bo.reset(); cf_bo.reset(); cbr_bo.reset();
+#endif
+    font_bo.reset();
+    tables.reset();
+  }
+
+protected:
+  void init_opengl() {
+    // The shaders take the catalog as an array, so ask for one before
+    // it's uploaded
+    enabler.textures.use_layers(GLEW_VERSION_3_1);
+    renderer_opengl::init_opengl();
+    fallback = true;
+    if (!GLEW_VERSION_3_1) {
+      cout << "PRINT_MODE:SHADER needs OpenGL 3.1, using STANDARD" << endl;
+      return;
+    }
+    if (!build_program()) {
+      enabler.textures.use_layers(false);
+      cout << "PRINT_MODE:SHADER could not build its shaders, using STANDARD" << endl;
+      return;
+    }
+    fallback = false;
+    font_bo.buffer(enabler.is_fullscreen() ?
+                   init.font.large_font_texpos :
+                   init.font.small_font_texpos,
+                   sizeof(init.font.small_font_texpos));
+  }
+
+  void uninit_opengl() {
+    release_gl();
+    renderer_opengl::uninit_opengl();
+  }
+
+  void allocate(int tiles) {
+    if (fallback) {
+      renderer_opengl::allocate(tiles);
+      return;
+    }
+    // Only the positions stay on the CPU side
+    vertexes = static_cast<GLfloat*>(realloc(vertexes, sizeof(GLfloat) * tiles * 2 * 6));
+    assert(vertexes);
+    allocate_planes(tiles);
+  }
+
+  void draw(int vertex_count) {
+    if (fallback) {
+      renderer_opengl::draw(vertex_count);
+      return;
+    }
+    tables.update(catalog_coords(), catalog_count(), catalog_generation());
+    upload_planes();
+
+    gl_state.use_program(program);
+    glUniform2i(grid_uniform, gps.dimx, gps.dimy);
+    glUniform1i(layers_uniform, catalog_layered());
+    int unit = 0;
+    glActiveTexture(GL_TEXTURE0 + unit++);
+    glBindTexture(catalog_target(), catalog_texture());
+#ifdef GPS_PACKED_CELLS
+    cells_bo.bind(GL_TEXTURE0 + unit++, GL_RGBA32UI);
+#else
+    screen_bo.bind(GL_TEXTURE0 + unit++, GL_RGBA8UI);
+    texpos_bo.bind(GL_TEXTURE0 + unit++, long_format());
+    addcolor_bo.bind(GL_TEXTURE0 + unit++, GL_R8UI);
+    grayscale_bo.bind(GL_TEXTURE0 + unit++, GL_R8UI);
+    cf_bo.bind(GL_TEXTURE0 + unit++, GL_R8UI);
+    cbr_bo.bind(GL_TEXTURE0 + unit++, GL_R8UI);
+#endif
+    font_bo.bind(GL_TEXTURE0 + unit++, long_format());
+    tables.coords_bo.bind(GL_TEXTURE0 + unit++, GL_RGBA32F);
+    tables.palette_bo.bind(GL_TEXTURE0 + unit++, GL_RGBA32F);
+    glActiveTexture(GL_TEXTURE0);
+
+    // One pass does it all
+    gl_state.disable(GL_BLEND);
+    gl_state.disable(GL_ALPHA_TEST);
+    gl_state.disable_client(GL_COLOR_ARRAY);
+    gl_state.disable_client(GL_TEXTURE_COORD_ARRAY);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, vertexes);
+    glEnableVertexAttribArray(0);
+    glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+    glDisableVertexAttribArray(0);
+    gl_state.use_program(0);
+
+    printGLError();
+  }
+
+public:
+  void update_tile(int x, int y) {
+    if (fallback) {
+      renderer_opengl::update_tile(x, y);
+      return;
+    }
+    track_ttf(x, y);
+    const int tile = gps.tile_index(x, y);
+    if (dirty_begin >= dirty_end) {
+      dirty_begin = tile;
+      dirty_end = tile + 1;
+    } else {
+      dirty_begin = MIN(dirty_begin, tile);
+      dirty_end = MAX(dirty_end, tile + 1);
+    }
+  }
+
+  void update_all() {
+    if (fallback) {
+      renderer_opengl::update_all();
+      return;
+    }
+    glClear(GL_COLOR_BUFFER_BIT);
+    track_all_ttf();
+    dirty_begin = 0;
+    dirty_end = gps.dimx * gps.dimy;
+  }
+
+  renderer_shader() {
+    fallback = true;
+    program = 0;
+    grid_uniform = layers_uniform = -1;
+    dirty_begin = dirty_end = 0;
+  }
+};
+
+// PRINT_MODE:INSTANCED
+//
+// Draws every tile as an instance of one unit quad. The CPU still resolves
+// each tile with screen_to_texid, but what it keeps and uploads per tile is
+// an 8-byte tile_instance instead of six vertexes' worth of colors and
+// texture coordinates. Needs OpenGL 3.1 and instanced arrays, and falls
+// back to PRINT_MODE:STANDARD without them.
+
+// Grid positions fit in a byte, as MAX_GRID_X and MAX_GRID_Y are 256
+struct tile_instance {
+  unsigned char x, y;
+  unsigned char fg, bg; // Palette indices
+  uint32_t texpos;
+};
+
+static const char *instance_vertex_shader =
+  "#version 140\n"
+  "\n"
+  "in vec2 corner; // Of the unit quad\n"
+  "in uvec4 tile;  // x, y, fg, bg; per instance\n"
+  "in uint texpos; // Per instance\n"
+  "\n"
+  "uniform ivec2 grid;\n"
+  "uniform bool layers;           // The catalog has a layer per texpos\n"
+  "uniform samplerBuffer coords;  // If not, texpos to left, right, top, bottom\n"
+  "uniform samplerBuffer palette; // See enablerst::palette_color\n"
+  "\n"
+  "flat out vec3 fg_color;\n"
+  "flat out vec3 bg_color;\n"
+  "out vec3 texcoord;\n"
+  "\n"
+  "void main() {\n"
+  "  fg_color = texelFetch(palette, int(tile.z)).rgb;\n"
+  "  bg_color = texelFetch(palette, int(tile.w)).rgb;\n"
+  "  if (layers) {\n"
+  "    texcoord = vec3(corner, float(texpos));\n"
+  "  } else {\n"
+  "    vec4 c = texelFetch(coords, int(texpos));\n"
+  "    texcoord = vec3(corner.x == 0.0 ? c.x : c.y, corner.y == 0.0 ? c.w : c.z, 0.0);\n"
+  "  }\n"
+  "  vec2 position = vec2(tile.xy) + corner;\n"
+  "  gl_Position = vec4(position.x * 2.0 / float(grid.x) - 1.0,\n"
+  "                     1.0 - position.y * 2.0 / float(grid.y), 0.0, 1.0);\n"
+  "}\n";
+
+class renderer_instanced : public renderer_opengl {
+  bool fallback; // Drawing as renderer_opengl
+  GLuint program;
+  GLint grid_uniform, layers_uniform;
+  GLuint quad_vbo, instance_vbo;
+  tile_tables tables;
+  tile_instance *instances;
+  int tiles; // Size of instances and instance_vbo
+  // Instances changed since the last upload; all of them if upload_all
+  bool upload_all;
+  int dirty_begin, dirty_end;
+
+  // GLEW only loads the ARB divisor when the driver lists the extension,
+  // and a 3.3 driver need not
+  static void attrib_divisor(GLuint index, GLuint divisor) {
+    if (GLEW_VERSION_3_3)
+      glVertexAttribDivisor(index, divisor);
+    else
+      glVertexAttribDivisorARB(index, divisor);
+  }
+
+  bool compile_program(shader &vs, shader &fs, const string &cache_key) {
+    GLuint vertex = vs.upload(GL_VERTEX_SHADER, false);
+    GLuint fragment = fs.upload(GL_FRAGMENT_SHADER, false);
+    if (!vertex || !fragment) {
+      if (vertex) glDeleteShader(vertex);
+      if (fragment) glDeleteShader(fragment);
+      return false;
+    }
+    program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glBindAttribLocation(program, 0, "corner");
+    glBindAttribLocation(program, 1, "tile");
+    glBindAttribLocation(program, 2, "texpos");
+    glBindFragDataLocation(program, 0, "color");
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    if (!shader::link(program, "renderer_instanced", cache_key)) {
+      glDeleteProgram(program);
+      program = 0;
+      return false;
+    }
+    return true;
+  }
+
+  bool build_program() {
+    shader vs, fs;
+    vs.load_source("instance_vertex_shader", instance_vertex_shader);
+    fs.load_source("tile_fragment_shader", tile_fragment_shader);
+    const string cache_key = vs.source() + fs.source();
+    program = shader::load_program("renderer_instanced", cache_key);
+    if (!program && !compile_program(vs, fs, cache_key)) return false;
+    gl_state.use_program(program);
+    glUniform1i(glGetUniformLocation(program, "catalog"), 0);
+    glUniform1i(glGetUniformLocation(program, "coords"), 1);
+    glUniform1i(glGetUniformLocation(program, "palette"), 2);
+    grid_uniform = glGetUniformLocation(program, "grid");
+    layers_uniform = glGetUniformLocation(program, "layers");
+    gl_state.use_program(0);
+    printGLError();
+    return true;
+  }
+
+  // (Re)creates the buffers at the current grid size
+  void create_buffers() {
+    static const GLfloat quad[] = { 0,0, 1,0, 0,1, 1,1 }; // A triangle strip
+    if (!quad_vbo) glGenBuffersARB(1, &quad_vbo);
+    if (!instance_vbo) glGenBuffersARB(1, &instance_vbo);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, quad_vbo);
+    glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(quad), quad, GL_STATIC_DRAW_ARB);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, instance_vbo);
+    glBufferDataARB(GL_ARRAY_BUFFER_ARB, tiles * sizeof(tile_instance), NULL, GL_STREAM_DRAW_ARB);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+    upload_all = true;
+    printGLError();
+  }
+
+  void upload_changes() {
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, instance_vbo);
+    if (upload_all) {
+      glBufferDataARB(GL_ARRAY_BUFFER_ARB, tiles * sizeof(tile_instance), instances, GL_STREAM_DRAW_ARB);
+    } else if (dirty_begin < dirty_end) {
+      glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, dirty_begin * sizeof(tile_instance),
+                         (dirty_end - dirty_begin) * sizeof(tile_instance),
+                         instances + dirty_begin);
+    }
+    upload_all = false;
+    dirty_begin = dirty_end = 0;
+  }
+
+  void release_gl() {
+    if (program) glDeleteProgram(program);
+    if (quad_vbo) glDeleteBuffersARB(1, &quad_vbo);
+    if (instance_vbo) glDeleteBuffersARB(1, &instance_vbo);
+    program = quad_vbo = instance_vbo = 0;
+    tables.reset();
+  }
+
+protected:
+  void init_opengl() {
+    const bool supported = GLEW_VERSION_3_1 && (GLEW_VERSION_3_3 || GLEW_ARB_instanced_arrays);
+    enabler.textures.use_layers(supported);
+    renderer_opengl::init_opengl();
+    fallback = true;
+    if (!supported) {
+      cout << "PRINT_MODE:INSTANCED needs OpenGL 3.1 and instanced arrays, using STANDARD" << endl;
+      return;
+    }
+    if (!build_program()) {
+      enabler.textures.use_layers(false);
+      cout << "PRINT_MODE:INSTANCED could not build its shaders, using STANDARD" << endl;
+      return;
+    }
+    fallback = false;
+    // Coming back from a resize that kept the grid
+    if (tiles) create_buffers();
+  }
+
+  void uninit_opengl() {
+    release_gl();
+    renderer_opengl::uninit_opengl();
+  }
+
+  void allocate(int tiles) {
+    if (fallback) {
+      renderer_opengl::allocate(tiles);
+      return;
+    }
+    // None of the per-vertex arrays are used
+    instances = static_cast<tile_instance*>(realloc(instances, sizeof(tile_instance) * tiles));
+    assert(instances);
+    this->tiles = tiles;
+  }
+
+  void reshape_gl() {
+    renderer_opengl::reshape_gl();
+    if (!fallback) create_buffers();
+  }
+
+  void draw(int vertex_count) {
+    if (fallback) {
+      renderer_opengl::draw(vertex_count);
+      return;
+    }
+    tables.update(catalog_coords(), catalog_count(), catalog_generation());
+    upload_changes();
+
+    gl_state.use_program(program);
+    glUniform2i(grid_uniform, gps.dimx, gps.dimy);
+    glUniform1i(layers_uniform, catalog_layered());
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(catalog_target(), catalog_texture());
+    tables.coords_bo.bind(GL_TEXTURE1, GL_RGBA32F);
+    tables.palette_bo.bind(GL_TEXTURE2, GL_RGBA32F);
+    glActiveTexture(GL_TEXTURE0);
+
+    gl_state.disable(GL_BLEND);
+    gl_state.disable(GL_ALPHA_TEST);
+    gl_state.disable_client(GL_VERTEX_ARRAY);
+    gl_state.disable_client(GL_COLOR_ARRAY);
+    gl_state.disable_client(GL_TEXTURE_COORD_ARRAY);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, quad_vbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, instance_vbo);
+    glVertexAttribIPointer(1, 4, GL_UNSIGNED_BYTE, sizeof(tile_instance), 0);
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(tile_instance),
+                           (GLvoid*)offsetof(tile_instance, texpos));
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    attrib_divisor(1, 1);
+    attrib_divisor(2, 1);
+    // Background and foreground both come out of the one pass
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, tiles);
+    attrib_divisor(1, 0);
+    attrib_divisor(2, 0);
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+    gl_state.enable_client(GL_VERTEX_ARRAY);
+    gl_state.use_program(0);
+
+    printGLError();
+  }
+
+public:
+  void update_tile(int x, int y) {
+    if (fallback) {
+      renderer_opengl::update_tile(x, y);
+      return;
+    }
+    const int tile = x*gps.dimy + y;
+    tile_instance &inst = instances[tile];
+    inst.x = x;
+    inst.y = y;
+    Either<texture_fullid,texture_ttfid> id = screen_to_texid(x, y);
+    if (id.isL) {
+      inst.fg = id.left.fg;
+      inst.bg = id.left.bg;
+      inst.texpos = id.left.texpos;
+    } else {
+      // TTF text is drawn on top by draw_ttf; leave a blank
+      inst.fg = inst.bg = 0;
+      inst.texpos = enabler.is_fullscreen() ?
+        init.font.large_font_texpos[' '] :
+        init.font.small_font_texpos[' '];
+    }
+    // update_all fills the instances on several threads, and uploads
+    // them all anyway
+    track_ttf(x, y);
+    if (!upload_all) {
+      if (dirty_begin >= dirty_end) {
+        dirty_begin = tile;
+        dirty_end = tile + 1;
+      } else {
+        dirty_begin = MIN(dirty_begin, tile);
+        dirty_end = MAX(dirty_end, tile + 1);
+      }
+    }
+  }
+
+  void update_all() {
+    if (!fallback) upload_all = true;
+    renderer_opengl::update_all();
+  }
+
+  renderer_instanced() {
+    fallback = true;
+    program = 0;
+    grid_uniform = layers_uniform = -1;
+    quad_vbo = instance_vbo = 0;
+    instances = NULL;
+    tiles = 0;
+    upload_all = true;
+    dirty_begin = dirty_end = 0;
+  }
+
+  ~renderer_instanced() {
+    free(instances);
+  }
+};
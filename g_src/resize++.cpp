@@ -1,11 +1,21 @@
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <map>
+#include <memory>
 #include <vector>
 
 #include "resize++.h"
+#include "worker_pool.hpp"
 
 #include <SDL/SDL.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define RESIZE_SSE2
+#endif
+
 //code adapted by David Olsen from Lanczos filtering article on wikipedia.org
 
 #ifndef M_PI
@@ -20,146 +30,293 @@ static inline double Lanczos(double x, int Radius)
   return Radius * std::sin(tmp) * std::sin(tmp / Radius) / (tmp * tmp);
 }
 
-static inline void Resample(SDL_Surface * src, SDL_Surface * dst, int filter)
+/* Lanczos weights for scaling one axis from src to dst pixels, in fixed
+   point. Output pixel i sums count[i] source pixels from start[i] on, times
+   weights[i*taps...], then shifts right by shift. Building one takes a
+   sin() per tap, so they're kept per (src, dst, filter) and reused. */
+struct resample_weights
+{
+    int taps, shift;
+    std::vector<int> start, count;
+    std::vector<Sint16> weights;
+};
+
+static int filter_radius(int filter, double scale)
 {
-    const double blur = 1.0;
-    double factor  = dst->w / (double)src->w;
-    double scale   = std::min(factor, 1.0) / blur;
-    int FilterRadius = filter;
-    if (filter < 1 )
-        FilterRadius = 1;
     if (filter > 3) //automatically determine fastest filter setting
     {
-        FilterRadius = 3;
-        if (scale < 0.67) FilterRadius = 2;
-        if (scale <= 0.5) FilterRadius = 1;        
+        if (scale <= 0.5) return 1;
+        if (scale < 0.67) return 2;
+        return 3;
     }
-    double support = FilterRadius / scale; 
-
-    std::vector<double> contribution_x(std::min((size_t)src->w, 5+(size_t)(2*support)));    
-    /* 5 = room for rounding up in calculations of start, stop and support */
-
-    Uint32 ** temp = new Uint32 * [src->h]; //array of source->height * dest->width
-    for (int i = 0 ; i < src->h; i++)
-        temp[i] = new Uint32 [dst->w];
+    return std::max(filter, 1);
+}
 
+static resample_weights *build_weights(int src, int dst, int filter, int max_shift)
+{
+    const double blur = 1.0;
+    const double factor = dst / (double)src;
+    double scale = std::min(factor, 1.0) / blur;
+    const int FilterRadius = filter_radius(filter, scale);
+    double support = FilterRadius / scale;
     if (support <= 0.5) { support = 0.5 + 1E-12; scale = 1.0; }
 
-    for (int x = 0; x < dst->w; ++x)
+    // The same contributions the floating point code used to take
+    std::vector<double> contribution;
+    std::vector<int> start(dst), count(dst);
+    double largest = 0;
+    for (int i = 0; i < dst; ++i)
     {
-        double center = (x + 0.5) / factor;
-        size_t start = (size_t)std::max(center - support + 0.5, (double)0);
-        size_t stop  = (size_t)std::min(center + support + 0.5, (double)src->w);
+        double center = (i + 0.5) / factor;
+        start[i] = (int)std::max(center - support + 0.5, (double)0);
+        int stop = (int)std::min(center + support + 0.5, (double)src);
+        count[i] = std::max(stop - start[i], 0);
         double density = 0.0;
-        size_t nmax = stop - start;
-        double s = start - center + 0.5;
-        double point[4] = {0,0,0,0};
-        Uint8 v;
-        double diff;
-
-        for (int y = 0; y < src->h; y++)
-        {                        
-            for (size_t n = 0; n < nmax; ++n)
-            {
-                if (y == 0)
-                { //only come up with the contribution list once per column.
-                    contribution_x[n] = Lanczos (s * scale, FilterRadius);                
-                    density += contribution_x[n];
-                    s++;
-                }
-                //it MUST be a 32-bit surface for following code to work correctly
-                Uint8 * p = (Uint8 *)src->pixels + y * src->pitch + (start+n) * 4;
-                for (int c = 0; c < 4; c++)
-                    point[c] += p[c] * contribution_x[n];
-            }
-            /* Normalize. Truncate to Uint8 values. Place in temp array*/
-            Uint8 * p = (Uint8 *)&temp[y][x];
-            for (size_t c = 0; c < 4; c++)
-            {
-                if (density != 0.0 && density != 1.0)
-                    point[c] /= density;
-                if (point[c] < 0)
-                    point[c] = 0;
-                if (point[c] > 255)
-                    point[c] = 255;
-	            v = (Uint8) point[c];
-	            diff = point[c] - (double)v;
-	            if (diff < 0)
-		            diff = -diff;
-	            if (diff >= 0.5)
-                    v++;
-	            p[c] = v;
-                point[c] = 0; //reset value for next loop
-            }
+        double s = start[i] - center + 0.5;
+        const size_t first = contribution.size();
+        for (int n = 0; n < count[i]; ++n, s++)
+        {
+            contribution.push_back(Lanczos(s * scale, FilterRadius));
+            density += contribution.back();
+        }
+        for (size_t n = first; n < contribution.size(); ++n)
+        {
+            if (density != 0.0 && density != 1.0)
+                contribution[n] /= density;
+            largest = std::max(largest, std::fabs(contribution[n]));
         }
     }
 
-    factor  = dst->h / (double)src->h;
-    scale   = std::min(factor, 1.0) / blur;
-    if (filter > 3) //automatically determine fastest filter setting
+    resample_weights *w = new resample_weights;
+    w->start.swap(start);
+    w->count.swap(count);
+    w->taps = *std::max_element(w->count.begin(), w->count.end());
+    // As many fraction bits as keep every weight in 16 bits
+    w->shift = max_shift;
+    while (w->shift > 0 && largest * (1 << w->shift) > 32767)
+        w->shift--;
+    w->weights.assign((size_t)dst * w->taps, 0);
+    const double one = 1 << w->shift;
+    for (int i = 0, c = 0; i < dst; ++i)
     {
-        FilterRadius = 3;
-        if (scale < 0.67) FilterRadius = 2;
-        if (scale <= 0.5) FilterRadius = 1;
+        Sint16 *out = &w->weights[(size_t)i * w->taps];
+        // Round each weight, then put the rounding error on the largest,
+        // so the sum comes out as it should
+        double exact = 0;
+        int sum = 0, peak = 0;
+        for (int n = 0; n < w->count[i]; ++n, ++c)
+        {
+            out[n] = (Sint16)std::floor(contribution[c] * one + 0.5);
+            exact += contribution[c] * one;
+            sum += out[n];
+            if (std::abs(out[n]) > std::abs(out[peak])) peak = n;
+        }
+        if (w->count[i])
+            out[peak] = (Sint16)std::min(std::max(out[peak] + (int)std::floor(exact + 0.5) - sum, -32767), 32767);
     }
-    support = FilterRadius / scale;
+    return w;
+}
 
-    std::vector<double> contribution_y(std::min((size_t)src->h, 5+(size_t)(2*support)));
+static Lock<> weights_lock;
+static std::map<std::pair<std::pair<int,int>,int>, std::shared_ptr<const resample_weights> > weights_cache;
 
-    if (support <= 0.5) { support = 0.5 + 1E-12; scale = 1.0; }
+/* Pixels across are bytes, so the weights get 14 bits of fraction; down,
+   they're 15 bits of temp, so 12 keep the sums well inside 32 bits */
+static std::shared_ptr<const resample_weights> get_weights(int src, int dst, int filter, int max_shift)
+{
+    // Every filter below 1, or above 3, means the same
+    const int mode = std::min(std::max(filter, 0), 4);
+    const std::pair<std::pair<int,int>,int> key(std::make_pair(src, dst), mode * 16 + max_shift);
+    weights_lock.lock();
+    auto it = weights_cache.find(key);
+    std::shared_ptr<const resample_weights> w;
+    if (it != weights_cache.end())
+        w = it->second;
+    weights_lock.unlock();
+    if (w) return w;
+    w.reset(build_weights(src, dst, filter, max_shift));
+    weights_lock.lock();
+    // Tile sizes only change on zoom, so a handful of pairs is the norm
+    if (weights_cache.size() >= 64)
+        weights_cache.clear();
+    weights_cache[key] = w;
+    weights_lock.unlock();
+    return w;
+}
+
+// Rounds, shifts and clamps one channel sum to a byte
+static inline Uint8 resample_channel(int sum, int shift)
+{
+    if (sum <= 0) return 0;
+    if (shift) sum = (sum + (1 << (shift - 1))) >> shift;
+    return (Uint8)std::min(sum, 255);
+}
+
+/* The first pass keeps 7 bits of fraction, clamped to [0, 255], so that
+   its rounding doesn't get amplified by the second pass's negative lobes */
+static const int temp_bits = 7;
+static const int temp_max = 255 << temp_bits;
+
+// Rounds, shifts and clamps one channel sum to the temp range
+static inline Uint16 resample_temp(int sum, int shift)
+{
+    if (sum <= 0) return 0;
+    shift -= temp_bits;
+    if (shift > 0) sum = (sum + (1 << (shift - 1))) >> shift;
+    else sum <<= -shift;
+    return (Uint16)std::min(sum, temp_max);
+}
+
+struct resample_job
+{
+    SDL_Surface *src, *dst;
+    Uint16 *temp; //source->height rows of dest->width pixels, 4 channels each
+    const resample_weights *wx, *wy;
+};
 
-    for (int y = 0; y<dst->h; ++y)
+/* Both passes work a channel at a time, so the channel order doesn't
+   matter. SSE2 does pairs of taps with one pmaddwd, four channels at once. */
+
+#ifdef RESIZE_SSE2
+// (a, b) repeated, for pmaddwd against interleaved pairs of channels
+static inline __m128i weight_pair(Sint16 a, Sint16 b)
+{
+    return _mm_set1_epi32((Uint16)a | ((Uint32)(Uint16)b << 16));
+}
+
+// Rounds and shifts sums of four channels
+static inline __m128i resample_shift(__m128i sum, int shift)
+{
+    if (shift <= 0)
+        return _mm_sll_epi32(sum, _mm_cvtsi32_si128(-shift));
+    return _mm_sra_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (shift - 1))),
+                         _mm_cvtsi32_si128(shift));
+}
+#endif
+
+// Scales source rows [begin, end) across into temp
+static void resample_across(void *ctx, int begin, int end)
+{
+    const resample_job *job = (const resample_job *)ctx;
+    const resample_weights &w = *job->wx;
+    const int width = job->dst->w;
+    for (int y = begin; y < end; y++)
     {
-        double center = (y + 0.5) / factor;
-        size_t start = (size_t)std::max(center - support + 0.5, (double)0);
-        size_t stop  = (size_t)std::min(center + support + 0.5, (double)src->h);
-        double density = 0.0;
-        size_t nmax = stop-start;
-        double s = start - center+0.5;
-        double point[4] = {0,0,0,0};
-        Uint8 v;
-        double diff;
-        
-        for (int x=0; x<dst->w; x++)
-        {    
-            for (size_t n=0; n<nmax; ++n)
+        const Uint8 *row = (const Uint8 *)job->src->pixels + y * job->src->pitch;
+        Uint16 *out = job->temp + (size_t)y * width * 4;
+        for (int x = 0; x < width; x++, out += 4)
+        {
+            const Uint8 *p = row + w.start[x] * 4;
+            const Sint16 *k = &w.weights[(size_t)x * w.taps];
+            const int count = w.count[x];
+#ifdef RESIZE_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            __m128i sum = zero;
+            int n = 0;
+            for (; n + 1 < count; n += 2)
+            {
+                const __m128i two = _mm_loadl_epi64((const __m128i *)(p + n * 4));
+                const __m128i pair = _mm_unpacklo_epi8(_mm_unpacklo_epi8(two, _mm_srli_si128(two, 4)), zero);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, weight_pair(k[n], k[n + 1])));
+            }
+            if (n < count)
             {
-                if (x == 0)
-                {
-                    contribution_y[n] = Lanczos(s * scale, FilterRadius);
-                    density += contribution_y[n];
-                    s++;
-                }
-                Uint8 * p = (Uint8 *)&temp[start+n][x];
+                Uint32 one;
+                memcpy(&one, p + n * 4, 4);
+                const __m128i pair = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(one), zero), zero);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, weight_pair(k[n], 0)));
+            }
+            sum = _mm_packs_epi32(resample_shift(sum, w.shift - temp_bits), zero);
+            sum = _mm_min_epi16(_mm_max_epi16(sum, zero), _mm_set1_epi16(temp_max));
+            _mm_storel_epi64((__m128i *)out, sum);
+#else
+            int sum[4] = {0, 0, 0, 0};
+            for (int n = 0; n < count; n++)
                 for (int c = 0; c < 4; c++)
-                    point[c] += p[c] * contribution_y[n];
+                    sum[c] += p[n * 4 + c] * k[n];
+            for (int c = 0; c < 4; c++)
+                out[c] = resample_temp(sum[c], w.shift);
+#endif
+        }
+    }
+}
+
+// Scales temp down into dest rows [begin, end)
+static void resample_down(void *ctx, int begin, int end)
+{
+    const resample_job *job = (const resample_job *)ctx;
+    const resample_weights &w = *job->wy;
+    const int width = job->dst->w;
+    const int shift = w.shift + temp_bits;
+    const size_t stride = (size_t)width * 4;
+    for (int y = begin; y < end; y++)
+    {
+        const Uint16 *rows = job->temp + (size_t)w.start[y] * stride;
+        const Sint16 *k = &w.weights[(size_t)y * w.taps];
+        const int count = w.count[y];
+        //destination must also be a 32 bit surface for this to work!
+        Uint8 *out = (Uint8 *)job->dst->pixels + y * job->dst->pitch;
+        int x = 0;
+#ifdef RESIZE_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+            for (int n = 0; n < count; n += 2)
+            {
+                // An odd last tap pairs with itself, weighted 0
+                const bool odd = n + 1 == count;
+                const Uint16 *a = rows + n * stride + x * 4;
+                const Uint16 *b = odd ? a : a + stride;
+                const __m128i weight = weight_pair(k[n], odd ? 0 : k[n + 1]);
+                const __m128i a01 = _mm_loadu_si128((const __m128i *)a);
+                const __m128i b01 = _mm_loadu_si128((const __m128i *)b);
+                const __m128i a23 = _mm_loadu_si128((const __m128i *)(a + 8));
+                const __m128i b23 = _mm_loadu_si128((const __m128i *)(b + 8));
+                s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi16(a01, b01), weight));
+                s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi16(a01, b01), weight));
+                s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi16(a23, b23), weight));
+                s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi16(a23, b23), weight));
             }
-            //destination must also be a 32 bit surface for this to work!
-            Uint8 * p = (Uint8 *)dst->pixels + y * dst->pitch + x * 4;
-            for (size_t c = 0; c < 4; c++)
+            const __m128i lo = _mm_packs_epi32(resample_shift(s0, shift), resample_shift(s1, shift));
+            const __m128i hi = _mm_packs_epi32(resample_shift(s2, shift), resample_shift(s3, shift));
+            _mm_storeu_si128((__m128i *)(out + x * 4), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; x < width; x++)
+        {
+            int sum[4] = {0, 0, 0, 0};
+            for (int n = 0; n < count; n++)
             {
-                if (density != 0.0 && density != 1.0)
-                    point[c] /= density;
-                if (point[c] < 0)
-                    point[c] = 0;
-                if (point[c] > 255)
-                    point[c] = 255;
-                v = (Uint8) point[c];
-	            diff = point[c] - (double)v;
-	            if (diff < 0)
-		            diff = -diff;
-	            if (diff >= 0.5)
-			        v++;
-	            p[c] = v;
-                point[c] = 0;
+                const Uint16 *p = rows + n * stride + x * 4;
+                for (int c = 0; c < 4; c++)
+                    sum[c] += p[c] * k[n];
             }
+            for (int c = 0; c < 4; c++)
+                out[x * 4 + c] = resample_channel(sum[c], shift);
         }
     }
+}
+
+// Both surfaces MUST be 32-bit for this to work correctly
+void SDL_Resample(SDL_Surface * src, SDL_Surface * dst, int filter)
+{
+    std::shared_ptr<const resample_weights> wx = get_weights(src->w, dst->w, filter, 14);
+    std::shared_ptr<const resample_weights> wy = get_weights(src->h, dst->h, filter, 12);
+    std::vector<Uint16> temp((size_t)src->h * dst->w * 4);
 
-    //free the temp array, so we don't leak any memory
-    for (int i = 0 ; i < src->h; i++)
-        delete [] temp[i];
-    delete [] temp;
+    resample_job job = { src, dst, &temp[0], wx.get(), wy.get() };
+    // Tiles aren't worth waking the workers for; whole images are
+    if ((size_t)dst->w * dst->h >= 256 * 256)
+    {
+        render_workers.run(resample_across, &job, src->h);
+        render_workers.run(resample_down, &job, dst->h);
+    }
+    else
+    {
+        resample_across(&job, 0, src->h);
+        resample_down(&job, 0, dst->h);
+    }
 }
 
 static inline Uint32 get_pixel(SDL_Surface *surface, int x, int y)
@@ -254,7 +411,7 @@ SDL_Surface* SDL_Resize(SDL_Surface *src, int new_w, int new_h, bool free, int f
         SDL_FreeSurface(src);
     src = temp;
 
-    Resample(src,dst,filter);
+    SDL_Resample(src,dst,filter);
 
     SDL_FreeSurface(temp);
     if (is_alpha)
@@ -62,7 +62,12 @@
 
 #include <SDL/SDL.h>
 
+// Images of 256x256 and up are scaled on render_workers, waiting for any
+// job already running there, so don't call these from inside one.
 SDL_Surface * SDL_Resize(SDL_Surface *src, float scale_factor,   bool free_src = true, int filter = 4);
 SDL_Surface * SDL_Resize(SDL_Surface *src, int new_w, int new_h, bool free_src = true, int filter = 4);
+// Scales src into dst, both 32-bit surfaces in the same format, without
+// SDL_Resize's conversions around it
+void SDL_Resample(SDL_Surface *src, SDL_Surface *dst, int filter = 4);
 
 #endif
@@ -1,30 +1,177 @@
 #include <cassert>
+#include <climits>
+#include <cmath>
 
 #include "enabler.h"
 #include "init.h"
+#include "worker_pool.hpp"
 
-// Used to sort textures
-struct vsize_pos {
-  int h, w;
-  SDL_Surface *s;
-  long pos;
-  // Assigned texture-catalog coordinates
-  int x, y;
+// Bottom-left skyline packer. The catalog's free space is kept as the
+// outline of what's been placed so far, so rectangles can be added to a
+// catalog that's already packed.
+class skyline_packer {
+  struct segment {
+    int x, y, w;
+  };
+  vector<segment> segments; // Left to right, covering the whole width
+  int width, height;
+
+  // Lowest y a w by h rectangle starting at segment i can sit at, or -1
+  int fit(int i, int w, int h) {
+    if (segments[i].x + w > width) return -1;
+    int y = 0;
+    for (int j = i, left = w; left > 0; j++) {
+      y = MAX(y, segments[j].y);
+      if (y + h > height) return -1;
+      left -= segments[j].w;
+    }
+    return y;
+  }
+
+ public:
+  void reset(int width, int height) {
+    this->width = width;
+    this->height = height;
+    segments.clear();
+    segment all = { 0, 0, width };
+    segments.push_back(all);
+  }
 
-  bool operator< (struct vsize_pos y) const {
-    // sort produces an ascending order. We want descending. Don't argue.
-    if (h > y.h) return true;
-    return false;
+  // Makes the area larger, keeping what's placed
+  void grow(int width, int height) {
+    if (width > this->width) {
+      segment right = { this->width, 0, width - this->width };
+      segments.push_back(right);
+      this->width = width;
+    }
+    this->height = MAX(this->height, height);
+  }
+
+  int used_height() const {
+    int h = 0;
+    for (size_t i = 0; i < segments.size(); i++)
+      h = MAX(h, segments[i].y);
+    return h;
+  }
+
+  // Places a w by h rectangle, lowest first, then leftmost. False if
+  // there's no room.
+  bool insert(int w, int h, int &x, int &y) {
+    int best = -1, best_y = INT_MAX;
+    for (size_t i = 0; i < segments.size(); i++) {
+      const int fy = fit(i, w, h);
+      if (fy >= 0 && fy < best_y) {
+        best = i;
+        best_y = fy;
+      }
+    }
+    if (best < 0) return false;
+    x = segments[best].x;
+    y = best_y;
+    // The rectangle's top edge replaces whatever outline it covers
+    segment top = { x, y + h, w };
+    segments.insert(segments.begin() + best, top);
+    for (size_t j = best + 1; j < segments.size();) {
+      const int overlap = x + w - segments[j].x;
+      if (overlap <= 0) break;
+      if (overlap >= segments[j].w) {
+        segments.erase(segments.begin() + j);
+        continue;
+      }
+      segments[j].x += overlap;
+      segments[j].w -= overlap;
+      break;
+    }
+    // Join neighbours of the same height
+    for (size_t j = 1; j < segments.size();) {
+      if (segments[j].y == segments[j-1].y) {
+        segments[j-1].w += segments[j].w;
+        segments.erase(segments.begin() + j);
+      } else
+        j++;
+    }
+    return true;
   }
 };
 
+// Where each texture sits in the catalog, and what's changed since it was
+// uploaded. Kept out of class textures, as enablerst's layout is shared
+// with the game.
+struct catalog_rect {
+  int x, y, w, h; // Border included; w is 0 if not placed
+};
+
+static struct catalog_layout {
+  int width, height;
+  skyline_packer packer;
+  vector<catalog_rect> rects;  // By texture position
+  vector<catalog_rect> spare;  // Given up by deleted or resized textures
+  vector<bool> changed;        // By texture position; under changed_lock
+  bool any_changed;
+  long texpos_count;           // Size of textures::gl_texpos
+  unsigned int generation;     // Bumped whenever texture coordinates change
+  bool want_layers;            // See textures::use_layers
+  GLenum target;               // What gl_catalog is bound as
+  long layers;                 // Layers of a layered catalog; 0 if packed
+} catalog;
+
+// The game marks textures changed on the simulation thread, while the
+// main thread uploads them
+static Lock<> changed_lock;
+
+void textures::mark_changed(long pos) {
+  changed_lock.lock();
+  if (catalog.changed.size() <= pos)
+    catalog.changed.resize(pos + 1, false);
+  catalog.changed[pos] = true;
+  catalog.any_changed = true;
+  changed_lock.unlock();
+}
+
+// Moves the changed set into changed, leaving it empty. Returns false if
+// nothing had changed.
+static bool take_changed(vector<bool> &changed) {
+  changed.clear();
+  changed_lock.lock();
+  changed.swap(catalog.changed);
+  const bool any = catalog.any_changed;
+  catalog.any_changed = false;
+  changed_lock.unlock();
+  return any;
+}
+
+unsigned int textures::catalog_generation() {
+  return catalog.generation;
+}
+
+long textures::catalog_count() {
+  return uploaded && !catalog.layers ? catalog.texpos_count : 0;
+}
+
+void textures::use_layers(bool layers) {
+  if (catalog.want_layers == layers) return;
+  catalog.want_layers = layers;
+  if (uploaded) {
+    remove_uploaded_textures();
+    upload_textures();
+  }
+}
+
+bool textures::catalog_layered() {
+  return uploaded && catalog.layers;
+}
+
+GLenum textures::catalog_target() {
+  return catalog.want_layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+}
+
 
 // Check whether a particular texture can be sized to some size,
 // assuming in RGBA 32-bit format
 bool testTextureSize(GLuint texnum, int w, int h) {
   GLint gpu_width;
-  glBindTexture(GL_TEXTURE_2D, texnum);
-      printGLError();
+  // Only the proxy is asked; binding texnum would tie it to
+  // GL_TEXTURE_2D, and the catalog may be an array.
   glTexImage2D(GL_PROXY_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
       printGLError();
   glGetTexLevelParameteriv(GL_PROXY_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &gpu_width);
@@ -34,87 +181,313 @@ bool testTextureSize(GLuint texnum, int w, int h) {
   return false;
 }
 
+// Writes a texture with a one-pixel border, made by repeating its edges,
+// to dst. Rows go bottom to top, as GL loads textures upside-down.
+static void copy_bordered(SDL_Surface *s, unsigned char *dst, int dst_pitch) {
+  const int w = s->w + 2, h = s->h + 2;
+  SDL_LockSurface(s);
+  for (int by = 0; by < h; by++) {
+    const int y = CLAMP(by - 1, 0, s->h - 1);
+    // We convert all textures to RGBA format at load-time
+    const unsigned char *src = (unsigned char*)s->pixels + y * s->pitch;
+    unsigned char *row = dst + (h - by - 1) * dst_pitch;
+    memcpy(row, src, 4);
+    memcpy(row + 4, src, s->w * 4);
+    memcpy(row + (w - 1) * 4, src + (s->w - 1) * 4, 4);
+  }
+  SDL_UnlockSurface(s);
+}
+
+// To make sure the right pixel is chosen when texturing, the coordinates
+// place us in the middle of the pixel we want. There's a one-pixel border
+// around each tile, so we offset by 1.
+static void set_texpos(struct gl_texpos &tp, const catalog_rect &r) {
+  tp.left   = ((double)r.x+1)       / (double)catalog.width;
+  tp.right  = ((double)r.x+r.w-1)   / (double)catalog.width;
+  tp.top    = ((double)r.y+1)       / (double)catalog.height;
+  tp.bottom = ((double)r.y+r.h-1)   / (double)catalog.height;
+}
+
+// Sets the filtering and wrapping of the bound catalog
+static void catalog_parameters(GLint wrap) {
+  GLint param = (init.window.flag.has_flag(INIT_WINDOW_FLAG_TEXTURE_LINEAR) ?
+    GL_LINEAR : GL_NEAREST);
+  glTexParameteri(catalog.target,GL_TEXTURE_MAG_FILTER,param);
+       printGLError();
+  glTexParameteri(catalog.target,GL_TEXTURE_MIN_FILTER,param);
+
+  glTexParameteri(catalog.target, GL_TEXTURE_WRAP_S, wrap);
+      printGLError();
+  glTexParameteri(catalog.target, GL_TEXTURE_WRAP_T, wrap);
+      printGLError();
+}
+
+// Loads or replaces part of a packed catalog, which is the one layer of a
+// texture array if the renderer asked for layers
+static void catalog_image(int w, int h, const void *pixels) {
+  if (catalog.target == GL_TEXTURE_2D_ARRAY)
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, w, h, 1, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, pixels);
+  else
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, pixels);
+}
+
+static void catalog_subimage(int x, int y, int layer, int w, int h, const void *pixels) {
+  if (catalog.target == GL_TEXTURE_2D_ARRAY)
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, layer, w, h, 1, GL_RGBA,
+                    GL_UNSIGNED_BYTE, pixels);
+  else
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
+
+// Copies a range of the ordered textures into the catalog image; see
+// upload_textures. A layered catalog has no ordering, and copies raws
+// positions as they are.
+struct catalog_compose {
+  const vector<SDL_Surface*> *raws;
+  const struct vsize_pos *ordered;
+  unsigned char *image;
+  int width;
+};
+
+// Used to sort textures
+struct vsize_pos {
+  int h, w;
+  long pos;
+
+  bool operator< (const struct vsize_pos &y) const {
+    // Tallest first, then widest; the skyline packs those best
+    if (h != y.h) return h > y.h;
+    return w > y.w;
+  }
+};
+
+static void compose_catalog(void *ctx, int begin, int end) {
+  const catalog_compose *c = static_cast<catalog_compose*>(ctx);
+  for (int i = begin; i < end; i++) {
+    const catalog_rect &r = catalog.rects[c->ordered[i].pos];
+    copy_bordered((*c->raws)[c->ordered[i].pos],
+                  c->image + (r.y * c->width + r.x) * 4, c->width * 4);
+  }
+}
+
+// Writes a texture to dst as it is, for a layered catalog
+static void copy_rows(SDL_Surface *s, unsigned char *dst) {
+  SDL_LockSurface(s);
+  for (int y = 0; y < s->h; y++)
+    memcpy(dst + y * s->w * 4, (unsigned char*)s->pixels + y * s->pitch, s->w * 4);
+  SDL_UnlockSurface(s);
+}
+
+static void compose_layers(void *ctx, int begin, int end) {
+  const catalog_compose *c = static_cast<catalog_compose*>(ctx);
+  const size_t layer_size = size_t(catalog.width) * catalog.height * 4;
+  for (int pos = begin; pos < end; pos++)
+    if ((*c->raws)[pos])
+      copy_rows((*c->raws)[pos], c->image + pos * layer_size);
+}
+
+// Textures changed since the catalog was uploaded, on their way into it.
+// With pixel buffer objects, the render workers copy them into a mapped
+// buffer, and glTexSubImage only queues a copy on the GPU instead of
+// waiting until it's done with the catalog.
+static struct upload_queue {
+  struct entry {
+    SDL_Surface *s;
+    int x, y, layer; // Where it goes in the catalog
+    size_t offset;   // Into the staging buffer
+  };
+  vector<entry> entries;
+  size_t size;
+  GLuint pbo;
+  unsigned char *staging;       // The mapped pbo, or client
+  vector<unsigned char> client; // Used without pixel buffer objects
+} uploads;
+
+static int upload_width(SDL_Surface *s) { return catalog.layers ? s->w : s->w + 2; }
+static int upload_height(SDL_Surface *s) { return catalog.layers ? s->h : s->h + 2; }
+
+static void queue_upload(SDL_Surface *s, int x, int y, int layer) {
+  upload_queue::entry e = { s, x, y, layer, uploads.size };
+  uploads.entries.push_back(e);
+  uploads.size += upload_width(s) * upload_height(s) * 4;
+  // Keep every texture at the alignment drivers like for PBO uploads
+  uploads.size = (uploads.size + 63) & ~size_t(63);
+}
+
+static void stage_uploads(void *, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    const upload_queue::entry &e = uploads.entries[i];
+    if (catalog.layers)
+      copy_rows(e.s, uploads.staging + e.offset);
+    else
+      copy_bordered(e.s, uploads.staging + e.offset, upload_width(e.s) * 4);
+  }
+}
+
+// Stages everything queued in client memory instead
+static const unsigned char *stage_in_client() {
+  uploads.client.resize(uploads.size);
+  uploads.staging = &uploads.client[0];
+  render_workers.run(stage_uploads, NULL, uploads.entries.size());
+  return uploads.staging;
+}
+
+// Sends everything queued to the catalog, which must be bound
+static void flush_uploads() {
+  if (uploads.entries.empty()) return;
+  // Offsets into the pbo, or pointers into client memory
+  const unsigned char *base = NULL;
+  uploads.staging = NULL;
+  if (GLEW_ARB_pixel_buffer_object) {
+    if (!uploads.pbo) glGenBuffersARB(1, &uploads.pbo);
+    glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, uploads.pbo);
+    // Orphan the previous batch, in case the GPU is still reading it
+    glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, uploads.size, NULL, GL_STREAM_DRAW_ARB);
+    uploads.staging = (unsigned char*)glMapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+    if (uploads.staging) {
+      render_workers.run(stage_uploads, NULL, uploads.entries.size());
+      if (!glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB)) {
+        // The buffer's contents were lost
+        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+        base = stage_in_client();
+      }
+    } else {
+      glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+      base = stage_in_client();
+    }
+  } else
+    base = stage_in_client();
+  for (size_t i = 0; i < uploads.entries.size(); i++) {
+    const upload_queue::entry &e = uploads.entries[i];
+    catalog_subimage(e.x, e.y, e.layer, upload_width(e.s), upload_height(e.s),
+                     base + e.offset);
+  }
+  if (!base) glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+  printGLError();
+  uploads.entries.clear();
+  uploads.size = 0;
+  uploads.staging = NULL;
+}
+
+// Uploads the catalog as a texture array with one layer per texture
+// position, if the renderer takes one and every texture is the same size,
+// as a single tileset is. Layers need no packing and no borders, and the
+// renderer finds a texture by its position alone.
+bool textures::upload_layers() {
+  int w = 0, h = 0;
+  for (long pos = 0; pos < raws.size(); pos++) {
+    if (!raws[pos]) continue;
+    if (!w) {
+      w = raws[pos]->w;
+      h = raws[pos]->h;
+    } else if (raws[pos]->w != w || raws[pos]->h != h)
+      return false;
+  }
+  if (!w) return false;
+  // Leave layers free for textures added later, as the packed catalog
+  // leaves room
+  GLint max_layers = 0;
+  glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+  if (raws.size() > max_layers) return false;
+  const long layers = MIN(long(raws.size() + raws.size() / 4 + 1), long(max_layers));
+  GLint gpu_width = 0;
+  glTexImage3D(GL_PROXY_TEXTURE_2D_ARRAY, 0, GL_RGBA, w, h, layers, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, NULL);
+  glGetTexLevelParameteriv(GL_PROXY_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_WIDTH, &gpu_width);
+  printGLError();
+  if (gpu_width != w) return false;
+  catalog.width = w;
+  catalog.height = h;
+  catalog.layers = layers;
+
+  // Rows go top to bottom here; the renderers sample layers that way up
+  std::vector<unsigned char> image(size_t(w) * h * 4 * raws.size(), 0);
+  catalog_compose compose = { &raws, NULL, &image[0], w };
+  render_workers.run(compose_layers, &compose, raws.size());
+  glBindTexture(GL_TEXTURE_2D_ARRAY, gl_catalog);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, w, h, layers, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, NULL);
+  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, w, h, raws.size(), GL_RGBA,
+                  GL_UNSIGNED_BYTE, &image[0]);
+  printGLError();
+  catalog_parameters(GL_CLAMP_TO_EDGE);
+
+  // The layer is the texture position, so there are no coordinates
+  delete[] gl_texpos;
+  gl_texpos = NULL;
+  catalog.texpos_count = raws.size();
+  catalog.rects.clear();
+  catalog.spare.clear();
+  catalog.generation++;
+  return true;
+}
+
 // Texture catalog implementation
 void textures::upload_textures() {
   if (uploaded) return; // Don't bother
   if (!enabler.uses_opengl()) return; // No uploading
-  glEnable(GL_TEXTURE_2D);
+  // Everything goes up now; whatever changes from here on goes up next time
+  vector<bool> changed;
+  take_changed(changed);
+  gl_state.enable(GL_TEXTURE_2D);
   printGLError();
   glGenTextures(1, &gl_catalog);
   printGLError();
+  catalog.target = catalog_target();
+  if (catalog.want_layers && upload_layers()) {
+    uploaded=true;
+    return;
+  }
+  catalog.layers = 0;
 
-  // First, sort the textures by vertical size. We'll want to place the large
-  // ones first.
-  // Since we mustn't alter the raws array, first thing is to create a new one.
-  // We pretend textures are one pixel larger than they actually are in either
-  // direction, to avoid border scuffles when interpolating.
+  // Place the large textures first. We pretend textures are one pixel
+  // larger than they actually are in either direction, to avoid border
+  // scuffles when interpolating.
   std::vector<vsize_pos> ordered;
-  long pos = 0;
-  for (std::vector<SDL_Surface *>::iterator it = raws.begin();
-       it != raws.end(); ++it) {
-    if (*it) {
+  long area = 0;
+  int catalog_width = 1;
+  for (long pos = 0; pos < raws.size(); pos++) {
+    if (raws[pos]) {
       vsize_pos item;
-      item.h = (*it)->h+2;
-      item.w = (*it)->w+2;
-      item.s = *it;
+      item.h = raws[pos]->h+2;
+      item.w = raws[pos]->w+2;
       item.pos = pos;
       ordered.push_back(item);
+      area += item.w * item.h;
+      catalog_width = MAX(catalog_width, item.w);
     }
-    pos++;
   }
   sort(ordered.begin(), ordered.end());
 
-  /* Tiling algorithm:
-  **
-  ** Given a particular texture width, we pack tiles from largest to smallest
-  ** by reserving rows for tiles with a particular height or lower.
-  ** This does lead to space wastage when a row has, say, one 32x32 tile and
-  ** fifteen 16x16 tiles, but generally not very much.
-  **
-  ** Possible improvement: Allow for multiple rows of smaller tiles inside
-  ** a row that's at least twice as high as the smaller tiles are.
-   */
-
-  // Set the initial width to the minimum possible
-  int catalog_width = 0;
-  for (int i=0; i < ordered.size(); i++)
-    if (catalog_width < ordered[i].w) catalog_width = ordered[i].w;
-  const int width_increment = 4; // For speed, not that it matters.
+  // Aim for a square catalog; a square one is less likely to run into
+  // dimensional limits. Start from the smallest square that could hold
+  // everything, and widen until the packing fits.
+  catalog_width = MAX(catalog_width, int(sqrt(double(area))));
+  catalog.rects.assign(raws.size(), catalog_rect());
   int catalog_height;
-  // Figure out what the optimal texture width is
-  // This may not be actually be an approximately square texture, but for the
-  // moment that's what we're aiming for. On GPUs without the NPOT extension,
-  // rectangular textures may actulaly use less video memory.
-  // However, a square one is less likely to run into dimensional limits.
-  for(;;) {
-    int catalog_x = 0;
-    int catalog_y = 0;
-    int row_height = ordered[0].h;
-    catalog_height = row_height;
-    for (int pos = 0; pos < ordered.size(); pos++) {
-      // Check whether we must start a new row
-      if (catalog_x + ordered[pos].w > catalog_width) {
-	catalog_x = 0;
-	catalog_y = catalog_height;
-	row_height = ordered[pos].h;
-	catalog_height += row_height;
-      }
-      // Tentatively install tile at catalog_x, catalog_y
-      ordered[pos].x = catalog_x;
-      ordered[pos].y = catalog_y;
-      // Goto next tile
-      catalog_x += ordered[pos].w;
+  for (;;) {
+    catalog.packer.reset(catalog_width, INT_MAX / 2);
+    for (int i = 0; i < ordered.size(); i++) {
+      catalog_rect &r = catalog.rects[ordered[i].pos];
+      r.w = ordered[i].w;
+      r.h = ordered[i].h;
+      catalog.packer.insert(r.w, r.h, r.x, r.y);
     }
-    // If we didn't just cross "square", increment width and try again.
-    if (catalog_height > catalog_width)
-      catalog_width += width_increment;
-    else
-      break; // Otherwise we're done.
-   }
+    catalog_height = MAX(catalog.packer.used_height(), 1);
+    if (catalog_height <= catalog_width) break;
+    catalog_width += MAX(4, catalog_width / 16);
+  }
 
 #ifdef DEBUG
   std::cout << "Ideal catalog size: " << catalog_width << "x" << catalog_height << "\n";
 #endif
+  // Leave room for textures added later, so they can go in without a
+  // repack
+  const int packed_width = catalog_width, packed_height = catalog_height;
+  catalog_height += catalog_height / 4;
   
   // Check whether the GPU supports non-power-of-two textures
   bool npot = false;
@@ -130,99 +503,138 @@ void textures::upload_textures() {
     catalog_height = newy;
     std::cout << "GPU does not support non-power-of-two textures, using " << catalog_width << "x" << catalog_height << " catalog.\n";
   }
-  // Check whether the GPU will allow a texture of that size
+  // Check whether the GPU will allow a texture of that size, with or
+  // without the spare room
   if (!testTextureSize(gl_catalog, catalog_width, catalog_height)) {
-    MessageBox(NULL,"GPU unable to accommodate texture catalog. Retry without graphical tiles, update your drivers, or better yet update your GPU.", "GL error", MB_OK);
-    exit(EXIT_FAILURE);
+    catalog_width = packed_width;
+    catalog_height = packed_height;
+    if (!npot || !testTextureSize(gl_catalog, catalog_width, catalog_height)) {
+      MessageBox(NULL,"GPU unable to accommodate texture catalog. Retry without graphical tiles, update your drivers, or better yet update your GPU.", "GL error", MB_OK);
+      exit(EXIT_FAILURE);
+    }
   }
+  catalog.width = catalog_width;
+  catalog.height = catalog_height;
+  catalog.packer.grow(catalog_width, catalog_height);
+  catalog.spare.clear();
 
-  // Guess it will. Well, then, actually upload it
-  glBindTexture(GL_TEXTURE_2D, gl_catalog);
-      printGLError();
-  char *zeroes = new char[catalog_width*catalog_height*4];
-  memset(zeroes,0,sizeof(char)*catalog_width*catalog_height*4);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, catalog_width, catalog_height, 0, GL_RGBA,
-	       GL_UNSIGNED_BYTE, zeroes);
-  delete[] zeroes;
-      printGLError();
-  glBindTexture(GL_TEXTURE_2D, gl_catalog);
-      printGLError();
-  GLint param = (init.window.flag.has_flag(INIT_WINDOW_FLAG_TEXTURE_LINEAR) ?
-    GL_LINEAR : GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,param);
-       printGLError();
-  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,param);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-      printGLError();
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-      printGLError();
-  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+  // Put the whole catalog together, and upload it at once. The textures
+  // don't overlap, so they can be copied in on every thread we have.
+  std::vector<unsigned char> image(catalog_width * catalog_height * 4, 0);
+  if (ordered.size()) {
+    catalog_compose compose = { &raws, &ordered[0], &image[0], catalog_width };
+    render_workers.run(compose_catalog, &compose, ordered.size());
+  }
+  glBindTexture(catalog.target, gl_catalog);
       printGLError();
   // Performance isn't important here. Let's make sure there are no alignment issues.
   glPixelStorei(GL_PACK_ALIGNMENT, 1);
       printGLError();
   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
       printGLError();
-  // While storing the positions to gl_texpos.
+  catalog_image(catalog_width, catalog_height, &image[0]);
+      printGLError();
+  catalog_parameters(GL_CLAMP);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+      printGLError();
+  // Store the positions to gl_texpos.
   if (gl_texpos) delete[] gl_texpos;
-  gl_texpos = new struct gl_texpos[raws.size()];
-  for (int pos = 0; pos < ordered.size(); pos++) {
-    long raws_pos = ordered[pos].pos;
-    SDL_Surface *s = ordered[pos].s;
-    SDL_PixelFormat *f = s->format;
-    SDL_LockSurface(s);
-    // Make /real/ sure we get the GL format right.
-    unsigned char *pixels = new unsigned char[ordered[pos].w * ordered[pos].h * 4];
-    // Recall, ordered[pos].w is 2 larger than s->w because of the border.
-    for (int bx=0; bx < ordered[pos].w; bx++) {
-      int x = bx - 1;
-      if (x == -1) x++;
-      if (x == s->w) x--;
-      for (int by=0; by < ordered[pos].h; by++) {
-        int y = by - 1;
-        if (y == -1) y++;
-        if (y == s->h) y--;
-        // GL textures are loaded upside-down, Y=0 at the bottom
-        unsigned char *pixel_dst = &pixels[(ordered[pos].h - by - 1)*ordered[pos].w*4 + bx*4];
-        unsigned char *pixel_src = &((unsigned char*)s->pixels)[y*s->w*4 + x*4];
-        assert (pixel_dst < pixels + ordered[pos].w * ordered[pos].h * 4);
-        assert (pixel_src < (unsigned char*)s->pixels + s->w * s->h * 4);
-        // We convert all textures to RGBA format at load-time, further below
-        for (int i=0; i<4; i++) {
-          pixel_dst[i] = pixel_src[i];
-        }
-      }
-    }
-    // Right. Upload the texture to the catalog.
-    SDL_UnlockSurface(s);
-    glBindTexture(GL_TEXTURE_2D, gl_catalog);
-    printGLError();
-    glTexSubImage2D(GL_TEXTURE_2D, 0, ordered[pos].x, ordered[pos].y, ordered[pos].w, ordered[pos].h,
-		    GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-    delete[] pixels;
-    printGLError();
-    // Compute texture coordinates and store to gl_texpos for later output.
-    // To make sure the right pixel is chosen when texturing, we must
-    // pick coordinates that place us in the middle of the pixel we want.
-    //
-    // There's no real reason to use double instead of floats here, but
-    // no reason not to either, and it just might help with precision.
-    //
-    // There's a one-pixel border around each tile, so we offset by 1
-    gl_texpos[raws_pos].left   = ((double)ordered[pos].x+1)      / (double)catalog_width;
-    gl_texpos[raws_pos].right  = ((double)ordered[pos].x+1+s->w) / (double)catalog_width;
-    gl_texpos[raws_pos].top    = ((double)ordered[pos].y+1)      / (double)catalog_height;
-    gl_texpos[raws_pos].bottom = ((double)ordered[pos].y+1+s->h) / (double)catalog_height;
-  }
+  catalog.texpos_count = raws.size();
+  gl_texpos = new struct gl_texpos[catalog.texpos_count];
+  for (int i = 0; i < ordered.size(); i++)
+    set_texpos(gl_texpos[ordered[i].pos], catalog.rects[ordered[i].pos]);
+  catalog.generation++;
   // And that's that. Locked, loaded and ready for texturing.
   printGLError();
   uploaded=true;
 }
 
+bool textures::update_textures() {
+  if (!uploaded) {
+    upload_textures();
+    return true;
+  }
+  vector<bool> changed;
+  if (!take_changed(changed)) return false;
+  if (catalog.layers) return update_layers(changed);
+  if (catalog.rects.size() < raws.size())
+    catalog.rects.resize(raws.size(), catalog_rect());
+  if (catalog.texpos_count < raws.size()) {
+    struct gl_texpos *grown = new struct gl_texpos[raws.size()];
+    memcpy(grown, gl_texpos, catalog.texpos_count * sizeof(struct gl_texpos));
+    delete[] gl_texpos;
+    gl_texpos = grown;
+    catalog.texpos_count = raws.size();
+    catalog.generation++;
+  }
+  bool moved = false;
+  glBindTexture(catalog.target, gl_catalog);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (long pos = 0; pos < changed.size(); pos++) {
+    if (!changed[pos]) continue;
+    catalog_rect &r = catalog.rects[pos];
+    SDL_Surface *s = pos < raws.size() ? raws[pos] : NULL;
+    const int w = s ? s->w + 2 : 0, h = s ? s->h + 2 : 0;
+    if (r.w && (r.w != w || r.h != h)) {
+      // Deleted or resized; its space can go to a texture of its size
+      catalog.spare.push_back(r);
+      r.w = 0;
+    }
+    if (!s) continue;
+    if (!r.w) {
+      r.w = w;
+      r.h = h;
+      size_t i;
+      for (i = 0; i < catalog.spare.size(); i++)
+        if (catalog.spare[i].w == w && catalog.spare[i].h == h) break;
+      if (i < catalog.spare.size()) {
+        r = catalog.spare[i];
+        catalog.spare.erase(catalog.spare.begin() + i);
+      } else if (!catalog.packer.insert(w, h, r.x, r.y)) {
+        // Out of room; start over with a bigger catalog
+        remove_uploaded_textures();
+        upload_textures();
+        return true;
+      }
+      set_texpos(gl_texpos[pos], r);
+      moved = true;
+    }
+    queue_upload(s, r.x, r.y, 0);
+  }
+  flush_uploads();
+  if (moved) catalog.generation++;
+  return moved;
+}
+
+// update_textures for a layered catalog. Textures go into their own
+// layer, so nothing ever moves; only a texture of another size, or
+// running out of layers, calls for a new upload.
+bool textures::update_layers(const vector<bool> &changed) {
+  glBindTexture(GL_TEXTURE_2D_ARRAY, gl_catalog);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (long pos = 0; pos < changed.size(); pos++) {
+    if (!changed[pos]) continue;
+    SDL_Surface *s = pos < raws.size() ? raws[pos] : NULL;
+    if (!s) continue; // Deleted; its layer just goes unused
+    if (s->w != catalog.width || s->h != catalog.height || pos >= catalog.layers) {
+      remove_uploaded_textures();
+      upload_textures();
+      return true;
+    }
+    queue_upload(s, 0, 0, pos);
+  }
+  flush_uploads();
+  catalog.texpos_count = raws.size();
+  return false;
+}
+
 void textures::remove_uploaded_textures() {
   if (!uploaded) return; // Nothing to do
   glDeleteTextures(1, &gl_catalog);
+  if (uploads.pbo) glDeleteBuffersARB(1, &uploads.pbo);
+  uploads.pbo = 0;
+  uploads.entries.clear();
+  uploads.size = 0;
   uploaded=false;
 }
 
@@ -235,6 +647,7 @@ SDL_Surface *textures::get_texture_data(long pos) {
     SDL_FillRect(surf, NULL, SDL_MapRGB(surf->format, 255, 0, 255));
     raws.resize(pos+1);
     raws[pos] = surf;
+    mark_changed(pos);
     return raws[pos];
   }
 }
@@ -284,6 +697,7 @@ if(luminosity>255)luminosity=255;
 
  cleanup:
  SDL_UnlockSurface(s);
+ mark_changed(pos);
 
  enabler.reset_textures();
 }
@@ -330,12 +744,14 @@ long textures::add_texture(SDL_Surface *surface) {
   for (long pos=0; pos < sz; pos++) {
     if (raws[pos] == NULL) {
       raws[pos] = surface;
+      mark_changed(pos);
       return pos;
     }
   }
 
   // No free spot, make one
   raws.push_back(surface);
+  mark_changed(sz);
   return sz;
 }
 
@@ -394,5 +810,6 @@ void textures::delete_texture(long pos) {
   if (raws[pos]) {
     SDL_FreeSurface(raws[pos]);
     raws[pos] = NULL;
+    mark_changed(pos);
   }
 }
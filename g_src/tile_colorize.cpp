@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include "tile_colorize.h"
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define TILE_COLORIZE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define TILE_COLORIZE_SSE2
+#endif
+
+// x / 255, rounded, for x up to 255 * 255
+static inline unsigned div255(unsigned x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static inline void colorize_pixel(const uint8_t *src, uint8_t *dst,
+                                  const uint8_t *fg, const uint8_t *bg) {
+  const unsigned alpha = src[3];
+  for (int c = 0; c < 3; c++)
+    dst[c] = div255(alpha * div255(src[c] * fg[c]) + (255 - alpha) * bg[c]);
+  dst[3] = 0;
+}
+
+#ifdef TILE_COLORIZE_SSE2
+
+static inline __m128i div255_epu16(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Two pixels, widened to 16 bits a channel
+static inline __m128i colorize2(__m128i px, __m128i fg, __m128i bg) {
+  __m128i alpha = _mm_shufflelo_epi16(px, _MM_SHUFFLE(3,3,3,3));
+  alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3,3,3,3));
+  const __m128i tinted = div255_epu16(_mm_mullo_epi16(px, fg));
+  return div255_epu16(_mm_add_epi16(_mm_mullo_epi16(alpha, tinted),
+                                    _mm_mullo_epi16(_mm_sub_epi16(_mm_set1_epi16(255), alpha), bg)));
+}
+
+static inline void colorize4(const uint8_t *src, uint8_t *dst, __m128i fg, __m128i bg) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i px = _mm_loadu_si128((const __m128i*)src);
+  const __m128i lo = colorize2(_mm_unpacklo_epi8(px, zero), fg, bg);
+  const __m128i hi = colorize2(_mm_unpackhi_epi8(px, zero), fg, bg);
+  const __m128i out = _mm_and_si128(_mm_packus_epi16(lo, hi), _mm_set1_epi32(0x00ffffff));
+  _mm_storeu_si128((__m128i*)dst, out);
+}
+
+#endif // TILE_COLORIZE_SSE2
+
+#ifdef TILE_COLORIZE_AVX2
+
+static inline __m256i div255_epu16(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+// Four pixels, two to each 128-bit lane, widened to 16 bits a channel
+static inline __m256i colorize4(__m256i px, __m256i fg, __m256i bg) {
+  __m256i alpha = _mm256_shufflelo_epi16(px, _MM_SHUFFLE(3,3,3,3));
+  alpha = _mm256_shufflehi_epi16(alpha, _MM_SHUFFLE(3,3,3,3));
+  const __m256i tinted = div255_epu16(_mm256_mullo_epi16(px, fg));
+  return div255_epu16(_mm256_add_epi16(_mm256_mullo_epi16(alpha, tinted),
+                                       _mm256_mullo_epi16(_mm256_sub_epi16(_mm256_set1_epi16(255), alpha), bg)));
+}
+
+// Unpacking and packing both work within lanes, so the pixels come out in
+// the order they went in
+static inline void colorize8(const uint8_t *src, uint8_t *dst, __m256i fg, __m256i bg) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i px = _mm256_loadu_si256((const __m256i*)src);
+  const __m256i lo = colorize4(_mm256_unpacklo_epi8(px, zero), fg, bg);
+  const __m256i hi = colorize4(_mm256_unpackhi_epi8(px, zero), fg, bg);
+  const __m256i out = _mm256_and_si256(_mm256_packus_epi16(lo, hi), _mm256_set1_epi32(0x00ffffff));
+  _mm256_storeu_si256((__m256i*)dst, out);
+}
+
+#endif // TILE_COLORIZE_AVX2
+
+void colorize_tile(const uint8_t *src, int src_pitch, uint8_t *dst, int dst_pitch,
+                   int w, int h, uint32_t fg, uint32_t bg) {
+  uint8_t fgb[4], bgb[4];
+  memcpy(fgb, &fg, 4);
+  memcpy(bgb, &bg, 4);
+#if defined(TILE_COLORIZE_AVX2)
+  const __m256i fgv = _mm256_setr_epi16(fgb[0], fgb[1], fgb[2], 0, fgb[0], fgb[1], fgb[2], 0,
+                                        fgb[0], fgb[1], fgb[2], 0, fgb[0], fgb[1], fgb[2], 0);
+  const __m256i bgv = _mm256_setr_epi16(bgb[0], bgb[1], bgb[2], 0, bgb[0], bgb[1], bgb[2], 0,
+                                        bgb[0], bgb[1], bgb[2], 0, bgb[0], bgb[1], bgb[2], 0);
+#elif defined(TILE_COLORIZE_SSE2)
+  const __m128i fgv = _mm_setr_epi16(fgb[0], fgb[1], fgb[2], 0, fgb[0], fgb[1], fgb[2], 0);
+  const __m128i bgv = _mm_setr_epi16(bgb[0], bgb[1], bgb[2], 0, bgb[0], bgb[1], bgb[2], 0);
+#endif
+  for (int y = 0; y < h; y++) {
+    const uint8_t *s = src + y * src_pitch;
+    uint8_t *d = dst + y * dst_pitch;
+    int x = 0;
+#if defined(TILE_COLORIZE_AVX2)
+    for (; x + 8 <= w; x += 8)
+      colorize8(s + x * 4, d + x * 4, fgv, bgv);
+#elif defined(TILE_COLORIZE_SSE2)
+    for (; x + 4 <= w; x += 4)
+      colorize4(s + x * 4, d + x * 4, fgv, bgv);
+#endif
+    // The tail, or everything if we have no vector unit to speak of
+    for (; x < w; x++)
+      colorize_pixel(s + x * 4, d + x * 4, fgb, bgb);
+  }
+}
@@ -0,0 +1,22 @@
+#ifndef TILE_COLORIZE_H
+#define TILE_COLORIZE_H
+
+#include <stdint.h>
+
+// Colorizing for the 2D renderers' tile cache.
+//
+// Every pixel becomes the foreground color modulated by the texture,
+// blended over the background by the texture's alpha, in 8-bit fixed
+// point. Pixels are four bytes: the fourth is alpha on the way in, and is
+// left zero on the way out, as the tile surfaces have no alpha. fg and bg
+// hold four bytes in the same order, as SDL_MapRGB returns them for the
+// destination format.
+//
+// SSE2 does four pixels per iteration, AVX2 (when built with -mavx2)
+// eight; anything else gets the scalar loop. All of them give the same
+// result.
+
+void colorize_tile(const uint8_t *src, int src_pitch, uint8_t *dst, int dst_pitch,
+                   int w, int h, uint32_t fg, uint32_t bg);
+
+#endif
@@ -0,0 +1,162 @@
+#include "tile_diff.h"
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define TILE_DIFF_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define TILE_DIFF_SSE2
+#endif
+
+// OR up to 32 change bits, for the tiles starting at pos, into the bitmap
+static inline void set_bits(uint32_t *bitmap, int pos, uint32_t mask) {
+  if (!mask) return;
+  const int word = pos >> 5, shift = pos & 31;
+  bitmap[word] |= mask << shift;
+  if (shift) bitmap[word + 1] |= mask >> (32 - shift);
+}
+
+template<bool use_graphics>
+static inline bool tile_changed(const tile_planes &cur, const tile_planes &old, int i) {
+  if (((const uint32_t*)cur.screen)[i] != ((const uint32_t*)old.screen)[i])
+    return true;
+  if (!use_graphics)
+    return false;
+  return cur.texpos[i] != old.texpos[i] ||
+    cur.addcolor[i] != old.addcolor[i] ||
+    cur.grayscale[i] != old.grayscale[i] ||
+    cur.cf[i] != old.cf[i] ||
+    cur.cbr[i] != old.cbr[i];
+}
+
+#ifdef TILE_DIFF_SSE2
+
+static inline __m128i load16(const void *p) {
+  return _mm_loadu_si128((const __m128i*)p);
+}
+
+// Returns a 16-bit mask with a bit set for every tile that did *not* change.
+template<bool use_graphics>
+static inline uint32_t unchanged16(const tile_planes &cur, const tile_planes &old, int i) {
+  // Screen: four bytes per tile, four tiles per register
+  uint32_t same = 0;
+  for (int k = 0; k < 4; k++) {
+    const __m128i eq = _mm_cmpeq_epi32(load16(cur.screen + (i + k*4) * 4),
+                                       load16(old.screen + (i + k*4) * 4));
+    same |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << (k*4);
+  }
+  if (!use_graphics)
+    return same;
+
+  // Texpos: there's no 64-bit compare in SSE2, so AND each 32-bit half
+  // with its neighbour before taking one bit per long.
+  uint32_t same_texpos = 0;
+  if (sizeof(long) == 8) {
+    for (int k = 0; k < 8; k++) {
+      __m128i eq = _mm_cmpeq_epi32(load16(cur.texpos + i + k*2),
+                                   load16(old.texpos + i + k*2));
+      eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2,3,0,1)));
+      same_texpos |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << (k*2);
+    }
+  } else {
+    for (int k = 0; k < 4; k++) {
+      const __m128i eq = _mm_cmpeq_epi32(load16(cur.texpos + i + k*4),
+                                         load16(old.texpos + i + k*4));
+      same_texpos |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << (k*4);
+    }
+  }
+
+  // The byte planes line up sixteen tiles to a register
+  __m128i eq = _mm_cmpeq_epi8(load16(cur.addcolor + i), load16(old.addcolor + i));
+  eq = _mm_and_si128(eq, _mm_cmpeq_epi8(load16(cur.grayscale + i), load16(old.grayscale + i)));
+  eq = _mm_and_si128(eq, _mm_cmpeq_epi8(load16(cur.cf + i), load16(old.cf + i)));
+  eq = _mm_and_si128(eq, _mm_cmpeq_epi8(load16(cur.cbr + i), load16(old.cbr + i)));
+
+  return same & same_texpos & (uint32_t)_mm_movemask_epi8(eq);
+}
+
+#endif // TILE_DIFF_SSE2
+
+#ifdef TILE_DIFF_AVX2
+
+static inline __m256i load32(const void *p) {
+  return _mm256_loadu_si256((const __m256i*)p);
+}
+
+// Returns a 32-bit mask with a bit set for every tile that did *not* change.
+template<bool use_graphics>
+static inline uint32_t unchanged32(const tile_planes &cur, const tile_planes &old, int i) {
+  uint32_t same = 0;
+  for (int k = 0; k < 4; k++) {
+    const __m256i eq = _mm256_cmpeq_epi32(load32(cur.screen + (i + k*8) * 4),
+                                          load32(old.screen + (i + k*8) * 4));
+    same |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << (k*8);
+  }
+  if (!use_graphics)
+    return same;
+
+  uint32_t same_texpos = 0;
+  if (sizeof(long) == 8) {
+    for (int k = 0; k < 8; k++) {
+      const __m256i eq = _mm256_cmpeq_epi64(load32(cur.texpos + i + k*4),
+                                            load32(old.texpos + i + k*4));
+      same_texpos |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) << (k*4);
+    }
+  } else {
+    for (int k = 0; k < 4; k++) {
+      const __m256i eq = _mm256_cmpeq_epi32(load32(cur.texpos + i + k*8),
+                                            load32(old.texpos + i + k*8));
+      same_texpos |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << (k*8);
+    }
+  }
+
+  __m256i eq = _mm256_cmpeq_epi8(load32(cur.addcolor + i), load32(old.addcolor + i));
+  eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(load32(cur.grayscale + i), load32(old.grayscale + i)));
+  eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(load32(cur.cf + i), load32(old.cf + i)));
+  eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(load32(cur.cbr + i), load32(old.cbr + i)));
+
+  return same & same_texpos & (uint32_t)_mm256_movemask_epi8(eq);
+}
+
+#endif // TILE_DIFF_AVX2
+
+template<bool use_graphics>
+void diff_tiles(const tile_planes &cur, const tile_planes &old,
+                int begin, int end, uint32_t *bitmap) {
+  int i = begin;
+#if defined(TILE_DIFF_AVX2)
+  for (; i + 32 <= end; i += 32)
+    set_bits(bitmap, i, ~unchanged32<use_graphics>(cur, old, i));
+#elif defined(TILE_DIFF_SSE2)
+  for (; i + 16 <= end; i += 16)
+    set_bits(bitmap, i, ~unchanged16<use_graphics>(cur, old, i) & 0xffff);
+#endif
+  // The tail, or everything if we have no vector unit to speak of
+  for (; i < end; i++)
+    if (tile_changed<use_graphics>(cur, old, i))
+      bitmap[i >> 5] |= 1u << (i & 31);
+}
+
+void diff_cells(const tile_cell *cur, const tile_cell *old,
+                int begin, int end, uint32_t *bitmap) {
+  int i = begin;
+#if defined(TILE_DIFF_SSE2) || defined(TILE_DIFF_AVX2)
+  for (; i + 32 <= end; i += 32) {
+    uint32_t changed = 0;
+    for (int k = 0; k < 32; k++) {
+      const __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(cur + i + k)),
+                                        _mm_loadu_si128((const __m128i*)(old + i + k)));
+      changed |= (uint32_t)(_mm_movemask_epi8(eq) != 0xffff) << k;
+    }
+    set_bits(bitmap, i, changed);
+  }
+#endif
+  for (; i < end; i++) {
+    const uint32_t *a = (const uint32_t*)(cur + i), *b = (const uint32_t*)(old + i);
+    if ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | (a[3] ^ b[3]))
+      bitmap[i >> 5] |= 1u << (i & 31);
+  }
+}
+
+template void diff_tiles<true>(const tile_planes&, const tile_planes&, int, int, uint32_t*);
+template void diff_tiles<false>(const tile_planes&, const tile_planes&, int, int, uint32_t*);
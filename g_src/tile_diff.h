@@ -0,0 +1,61 @@
+#ifndef TILE_DIFF_H
+#define TILE_DIFF_H
+
+#include <stdint.h>
+#ifdef _MSC_VER
+# include <intrin.h>
+#endif
+
+// Change detection for renderer::display().
+//
+// The kernels compare a range of tiles of the gps planes against their _old
+// copies and set one bit per changed tile in a bitmap, bit (tile & 31) of
+// word (tile >> 5). Bits are OR-ed in, so the caller clears the bitmap, and it
+// must have one word of slack past the last tile.
+//
+// They are specialized on use_graphics at compile time: text-only displays
+// only ever look at the screen plane. SSE2 checks 16 tiles per iteration,
+// AVX2 (when built with -mavx2) 32; anything else gets the scalar loop.
+
+struct tile_planes {
+  const unsigned char *screen;
+  const long *texpos;
+  const char *addcolor;
+  const unsigned char *grayscale;
+  const unsigned char *cf;
+  const unsigned char *cbr;
+};
+
+template<bool use_graphics>
+void diff_tiles(const tile_planes &cur, const tile_planes &old,
+                int begin, int end, uint32_t *bitmap);
+
+// The whole state of one tile in a single 16-byte unit, for renderers built
+// with GPS_PACKED_CELLS. The first four bytes are exactly those of gps.screen.
+struct alignas(16) tile_cell {
+  unsigned char screen[4];
+  int32_t texpos;
+  char addcolor;
+  unsigned char grayscale;
+  unsigned char cf;
+  unsigned char cbr;
+  uint32_t unused; // Kept zero, so cells can be compared whole
+};
+static_assert(sizeof(tile_cell) == 16, "diff_cells and the cell shaders read a tile_cell as one 128-bit unit");
+
+// Same contract as diff_tiles, one 128-bit compare per tile.
+void diff_cells(const tile_cell *cur, const tile_cell *old,
+                int begin, int end, uint32_t *bitmap);
+
+// Index of the lowest set bit; word must be non-zero.
+static inline int lowest_bit(uint32_t word) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, word);
+  return (int)idx;
+#else
+  return __builtin_ctz(word);
+#endif
+}
+
+#endif
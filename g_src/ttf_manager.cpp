@@ -18,6 +18,7 @@ bool ttf_managerst::init(int ceiling, int tile_width) {
   for (auto it = textures.cbegin(); it != textures.cend(); ++it)
     SDL_FreeSurface(it->second);
   textures.clear();
+  atlas_reset(atlas_cells_x, atlas_cells_y);
   this->tile_width = tile_width;
   this->ceiling = ceiling;
   // Try progressively smaller point sizes until we find one that fits
@@ -71,7 +72,9 @@ int ttf_managerst::size_text(const string &text) {
   vector<Uint16> text_unicode;
   cp437_to_unicode(text, text_unicode);
   int width, height;
+  lock.lock();
   TTF_SizeUNICODE(font, &text_unicode[0], &width, &height);
+  lock.unlock();
   return (width + tile_width - 1) / tile_width;
 }
 
@@ -79,8 +82,13 @@ int ttf_managerst::size_text(const string &text) {
 ttf_details ttf_managerst::get_handle(const list<ttf_id> &text, justification just) {
   // Check for an existing handle
   handleid id = {text, just};
+  lock.lock();
   auto it = handles.find(id);
-  if (it != handles.end()) return it->second;
+  if (it != handles.end()) {
+    ttf_details ret = it->second;
+    lock.unlock();
+    return ret;
+  }
   // Right. Make a new one.
   int handle = ++max_handle;
   // Split out any tabs
@@ -143,10 +151,12 @@ ttf_details ttf_managerst::get_handle(const list<ttf_id> &text, justification ju
   handles[id] = ret;
   // We do the actual rendering in the render thread, later on.
   todo.push_back(todum(handle, split_text, ttf_height, pixel_offset, pixel_width));
+  lock.unlock();
   return ret;
 }
 
 SDL_Surface *ttf_managerst::get_texture(int handle) {
+  lock.lock();
   // Run any outstanding renders
   if (!todo.empty()) {
     vector<Uint16> text_unicode;
@@ -233,14 +243,143 @@ SDL_Surface *ttf_managerst::get_texture(int handle) {
   if (!tex) {
     cout << "Missing/broken TTF handle: " << handle << endl;
   }
+  lock.unlock();
   return tex;
 }
 
 void ttf_managerst::gc() {
-  // Just delete everything, for now.
-  for (auto it = textures.begin(); it != textures.end(); ++it)
-    SDL_FreeSurface(it->second);
-  textures.clear();
+  // Just forget everything, for now.
+  lock.lock();
   handles.clear();
-  todo.clear();
+  retired_handle = max_handle;
+  lock.unlock();
+}
+
+void ttf_managerst::release_retired(int handle) {
+  if (handle <= released_handle) return;
+  lock.lock();
+  for (auto it = textures.begin(); it != textures.end();) {
+    if (it->first <= handle) {
+      SDL_FreeSurface(it->second);
+      it = textures.erase(it);
+    } else
+      ++it;
+  }
+  lock.unlock();
+  for (auto it = atlas_strings.begin(); it != atlas_strings.end();) {
+    if (it->first <= handle) {
+      const int dropped = it->first;
+      ++it;
+      atlas_drop(dropped);
+    } else
+      ++it;
+  }
+  released_handle = handle;
+}
+
+void ttf_managerst::atlas_reset(int cells_x, int cells_y) {
+  atlas_cells_x = cells_x;
+  atlas_cells_y = cells_y;
+  atlas_slots.assign(cells_x * cells_y, atlas_slot()); // All free
+  atlas_strings.clear();
+  atlas_pending.clear();
+  atlas_pixels.clear();
+}
+
+// Frees the cells of a handle's text
+void ttf_managerst::atlas_drop(int handle) {
+  auto it = atlas_strings.find(handle);
+  if (it == atlas_strings.end()) return;
+  for (size_t i = 0; i < it->second.size(); i++)
+    if (it->second[i] >= 0)
+      atlas_slots[it->second[i]].handle = 0;
+  atlas_strings.erase(it);
+}
+
+// Finds a cell to put a slice in, evicting the least recently used one if
+// they're all taken. -1 if every cell is in use this frame.
+int ttf_managerst::atlas_evict() {
+  int best = -1;
+  for (size_t i = 0; i < atlas_slots.size(); i++) {
+    const atlas_slot &slot = atlas_slots[i];
+    if (!slot.handle) return i;
+    if (slot.last_used != atlas_frame &&
+        (best < 0 || atlas_frame - slot.last_used > atlas_frame - atlas_slots[best].last_used))
+      best = i;
+  }
+  if (best >= 0) {
+    const atlas_slot &victim = atlas_slots[best];
+    auto it = atlas_strings.find(victim.handle);
+    if (it != atlas_strings.end()) {
+      it->second[victim.column] = -1;
+      bool empty = true;
+      for (size_t i = 0; i < it->second.size(); i++)
+        if (it->second[i] >= 0) empty = false;
+      if (empty) atlas_strings.erase(it);
+    }
+  }
+  return best;
+}
+
+// Queues one column of a rendered string for upload into a cell
+void ttf_managerst::atlas_copy(SDL_Surface *text, int column, int cell) {
+  atlas_pending.push_back(cell);
+  const size_t start = atlas_pixels.size();
+  atlas_pixels.resize(start + tile_width * ceiling * 4);
+  unsigned char *out = &atlas_pixels[start];
+  SDL_Surface *conv = NULL;
+  if (text->format->BytesPerPixel != 4) {
+    conv = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32, 0, 0, 0, 0);
+    SDL_Surface *tmp = SDL_ConvertSurface(text, conv->format, SDL_SWSURFACE);
+    SDL_FreeSurface(conv);
+    conv = text = tmp;
+  }
+  if (SDL_MUSTLOCK(text)) SDL_LockSurface(text);
+  for (int y = 0; y < ceiling; y++) {
+    for (int x = 0; x < tile_width; x++, out += 4) {
+      const int sx = column * tile_width + x;
+      if (y >= text->h || sx >= text->w) {
+        out[0] = out[1] = out[2] = 0;
+        out[3] = 255;
+        continue;
+      }
+      const Uint32 pixel = *(Uint32*)((Uint8*)text->pixels + y * text->pitch + sx * 4);
+      SDL_GetRGB(pixel, text->format, &out[0], &out[1], &out[2]);
+      out[3] = 255;
+    }
+  }
+  if (SDL_MUSTLOCK(text)) SDL_UnlockSurface(text);
+  if (conv) SDL_FreeSurface(conv);
+}
+
+int ttf_managerst::atlas_cell(int handle, int column) {
+  auto it = atlas_strings.find(handle);
+  if (it != atlas_strings.end() && column < it->second.size() && it->second[column] >= 0) {
+    const int cell = it->second[column];
+    atlas_slots[cell].last_used = atlas_frame;
+    return cell;
+  }
+  SDL_Surface *text = get_texture(handle);
+  if (!text || column * tile_width >= text->w) return -1;
+  const int cell = atlas_evict();
+  if (cell < 0) return -1;
+  // atlas_evict may have dropped an entry, so look again
+  vector<int> &cells = atlas_strings[handle];
+  if (cells.size() <= column)
+    cells.resize((text->w + tile_width - 1) / tile_width, -1);
+  cells[column] = cell;
+  atlas_slot &slot = atlas_slots[cell];
+  slot.handle = handle;
+  slot.column = column;
+  slot.last_used = atlas_frame;
+  atlas_copy(text, column, cell);
+  return cell;
+}
+
+void ttf_managerst::atlas_take_uploads(vector<int> &cells, vector<unsigned char> &pixels) {
+  cells.swap(atlas_pending);
+  pixels.swap(atlas_pixels);
+  atlas_pending.clear();
+  atlas_pixels.clear();
+  atlas_frame++;
 }
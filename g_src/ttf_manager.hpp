@@ -10,9 +10,11 @@
 #endif
 #include <unordered_map>
 #include <list>
+#include <vector>
 
 using std::unordered_map;
 using std::list;
+using std::vector;
 
 struct handleid {
   list<ttf_id> text;
@@ -64,10 +66,34 @@ class ttf_managerst {
       handle(handle), text(t), height(h), pixel_offset(po), pixel_width(pw) {}
   };
   list<todum> todo;
+  // Handles are made by the simulation thread and rendered by the main one
+  Lock<> lock;
+  int retired_handle, released_handle; // See gc
+
+  // The atlas: tile-sized slices of rendered text, for the GL renderers.
+  // Each column of a string goes in its own cell, so a string needs no
+  // contiguous space; cells are evicted least recently used first. Only
+  // the main thread uses it, so it isn't locked.
+  struct atlas_slot {
+    int handle, column; // handle is 0 for a free cell
+    unsigned int last_used;
+  };
+  int atlas_cells_x, atlas_cells_y;
+  vector<atlas_slot> atlas_slots;
+  unordered_map<int, vector<int> > atlas_strings; // Handle to cell per column, or -1
+  unsigned int atlas_frame;
+  vector<int> atlas_pending;              // Cells placed since atlas_take_uploads
+  vector<unsigned char> atlas_pixels;     // And their contents, RGBA
+  int atlas_evict();
+  void atlas_copy(SDL_Surface *text, int column, int cell);
+  void atlas_drop(int handle);
 public:
   ttf_managerst() {
     font = NULL;
     max_handle = 1;
+    retired_handle = released_handle = 0;
+    atlas_cells_x = atlas_cells_y = 0;
+    atlas_frame = 0;
     tab_width = 2;
     em_width = 8;
   }
@@ -84,10 +110,28 @@ public:
   // Returns rendered text. Renders too, if necessary.
   // The returned SDL_Surface is owned by the ttf_managerst.
   SDL_Surface *get_texture(int handle);
-  // Garbage-collect ttf surfaces
+  // Garbage-collect ttf surfaces. Only the handles go at once; frames
+  // already drawn may still use their textures, so those are released
+  // later, by release_retired.
   void gc();
+  // Handles up to this one were dropped by the last gc
+  int retired() const { return retired_handle; }
+  // Frees the textures of handles up to this one
+  void release_retired(int handle);
   // Set tab-stop width (in ems, i.e. tile widths)
   void set_tab_width(double width) { tab_width = width; }
+  // Size of a tile, and so of an atlas cell, in pixels
+  int get_tile_width() const { return tile_width; }
+  int get_tile_height() const { return ceiling; }
+  // Empties the atlas and sets its size, in cells
+  void atlas_reset(int cells_x, int cells_y);
+  // The atlas cell holding the given column of a handle's text, which gets
+  // placed there if need be. -1 if the text is missing.
+  int atlas_cell(int handle, int column);
+  // Hands over the cells placed since the last call, for uploading; pixels
+  // gets get_tile_width() by get_tile_height() RGBA pixels per cell, rows
+  // top to bottom. Also starts a new frame for the LRU.
+  void atlas_take_uploads(vector<int> &cells, vector<unsigned char> &pixels);
   // Check if TTF is currently active
   bool ttf_active() const {
     return was_init() &&
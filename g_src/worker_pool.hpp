@@ -0,0 +1,124 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <vector>
+#include <thread> // For hardware_concurrency; the threads themselves are SDL's
+
+#include "mail.hpp"
+#include "g_basics.h"
+#include "init.h"
+
+// A fixed set of threads for splitting a loop over [0, count) into chunks.
+// The calling thread works on chunks too, and run() returns once all of
+// them are done. Threads are started on first use; RENDER_THREADS in
+// init.txt sets how many, counting the caller, with 0 meaning one per core.
+class worker_pool {
+ public:
+  typedef void (*job_fn)(void *ctx, int begin, int end);
+
+ private:
+  std::vector<SDL_Thread*> threads;
+  SDL_sem *start, *done;
+  Lock<> chunk_lock;
+  Lock<> run_lock; // Held for the whole of a run(), and while starting threads
+  bool started, quit;
+
+  // The job being run
+  job_fn job;
+  void *ctx;
+  int count, chunk_size, next;
+
+  // Returns false once the job is used up
+  bool take_chunk(int &begin, int &end) {
+    chunk_lock.lock();
+    begin = next;
+    next = MIN(next + chunk_size, count);
+    end = next;
+    chunk_lock.unlock();
+    return begin < end;
+  }
+
+  void drain() {
+    int begin, end;
+    while (take_chunk(begin, end))
+      job(ctx, begin, end);
+  }
+
+  static int thread_main(void *data) {
+    worker_pool *pool = static_cast<worker_pool*>(data);
+    for (;;) {
+      SDL_SemWait(pool->start);
+      if (pool->quit) return 0;
+      pool->drain();
+      SDL_SemPost(pool->done);
+    }
+  }
+
+  void start_threads() {
+    started = true;
+    int n = init_tuning.render_threads;
+    if (n <= 0) n = std::thread::hardware_concurrency();
+    for (int i = 1; i < n; i++) {
+      SDL_Thread *thread = SDL_CreateThread(thread_main, this);
+      if (!thread) break; // Make do with what we have
+      threads.push_back(thread);
+    }
+  }
+
+ public:
+  worker_pool() {
+    started = quit = false;
+    start = SDL_CreateSemaphore(0);
+    done  = SDL_CreateSemaphore(0);
+  }
+
+  ~worker_pool() {
+    quit = true;
+    for (size_t i = 0; i < threads.size(); i++)
+      SDL_SemPost(start);
+    for (size_t i = 0; i < threads.size(); i++)
+      SDL_WaitThread(threads[i], NULL);
+    SDL_DestroySemaphore(start);
+    SDL_DestroySemaphore(done);
+  }
+
+  // Number of threads taking part in run(), the caller included
+  int size() {
+    run_lock.lock();
+    if (!started) start_threads();
+    const int n = threads.size() + 1;
+    run_lock.unlock();
+    return n;
+  }
+
+  // Calls job on disjoint ranges covering [0, count), in parallel.
+  // Callers on other threads wait for the current job to finish; a job
+  // must not call run() itself.
+  void run(job_fn job, void *ctx, int count) {
+    if (count <= 0) return;
+    run_lock.lock();
+    if (!started) start_threads();
+    const int n = threads.size() + 1;
+    if (n == 1) {
+      run_lock.unlock();
+      job(ctx, 0, count);
+      return;
+    }
+    this->job = job;
+    this->ctx = ctx;
+    this->count = count;
+    next = 0;
+    // A few chunks per thread, so one slow chunk doesn't hold up the rest
+    chunk_size = MAX(1, count / (n * 4));
+    for (size_t i = 0; i < threads.size(); i++)
+      SDL_SemPost(start);
+    drain();
+    for (size_t i = 0; i < threads.size(); i++)
+      SDL_SemWait(done);
+    run_lock.unlock();
+  }
+};
+
+extern worker_pool render_workers;
+
+#endif